@@ -6,22 +6,42 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 
 #include "Cache.h"
+#include "Trace.h"
 
 #ifdef MEMORY_YYX
+const uint8_t Cache::RRPV_BITS;
+const uint8_t Cache::RRPV_MAX;
+const uint32_t Cache::BRRIP_EPSILON;
+const uint32_t Cache::DUEL_LEADER_SETS;
+const uint32_t Cache::PSEL_BITS;
+const uint32_t Cache::PSEL_MAX;
+
 Cache::Cache(MemoryManager *manager, Policy policy, Cache *lowerCache,
              bool writeBack, bool writeAllocate, int inclusionType,
              Cache *upperCache, int replacementType,
-             bool ifUsingVictimCache, int victimCacheCapacity, int victimCacheLatency) {
+             bool ifUsingVictimCache, int victimCacheCapacity, int victimCacheLatency,
+             bool tagOnly) {
   this->referenceCounter = 0;
   this->memory = manager;
   this->policy = policy;
   this->lowerCache = lowerCache;
+  this->tagOnly = tagOnly;
   if (!this->isPolicyValid()) {
     fprintf(stderr, "Policy invalid!\n");
     exit(-1);
   }
+  if (lowerCache != nullptr && lowerCache->tagOnly != tagOnly) {
+    fprintf(stderr, "Tag-only and data caches cannot be mixed!\n");
+    exit(-1);
+  }
+  // yyx add below
+  this->inclusionType = inclusionType; 
+  this->upperCache = upperCache; 
+  this->replacementType = replacementType; 
   this->initCache();
   this->statistics.numRead = 0;
   this->statistics.numWrite = 0;
@@ -30,36 +50,72 @@ Cache::Cache(MemoryManager *manager, Policy policy, Cache *lowerCache,
   this->statistics.totalCycles = 0;
   this->writeBack = writeBack;
   this->writeAllocate = writeAllocate;
-  // yyx add below
-  this->inclusionType = inclusionType; 
-  this->upperCache = upperCache; 
-  this->replacementType = replacementType; 
+  this->replacementPolicy.reset(ReplacementPolicy::create(
+      replacementType, policy.blockNum / policy.associativity,
+      policy.associativity));
+  this->currentPC = 0;
+  this->dram = nullptr;
+  this->currentCycle = 0;
   this->ifUsingVictimCache = ifUsingVictimCache;
   this->victimCacheCapacity = victimCacheCapacity;
-  if (this->ifUsingVictimCache && this->policy.associativity > 1){
-    fprintf(stderr, "Using victimCache but not direct associatity\n");
-    exit(-1);
-  }
+  this->beladyTime = MAXNEXTAPPEARTIME;
+  this->accessHint = MAXNEXTAPPEARTIME;
+  this->victimStatistics = this->statistics;
+  this->numBackInvalidation = 0;
+  this->numBackInvalidationFiltered = 0;
+  this->victimReplacementType = VICTIM_FIFO;
+  this->coreId = -1;
+  this->requestCore = -1;
+  this->requestExclusive = false;
+  this->grantExclusive = false;
+  this->parallel = false;
+  this->lockingCore = -1;
+  this->sharedLevel = nullptr;
+  this->coreLock = nullptr;
+  memset(&this->coherenceStatistics, 0, sizeof(this->coherenceStatistics));
   if (this->ifUsingVictimCache){
     printf("Using victim cache\n");
     this->victimCacheLatency = victimCacheLatency;
-    if (this->victimCacheLatency < 0){
+    if (victimCacheLatency < 0){
       fprintf(stderr, "Please specify victimCacheLatency!\n");
       exit(-1);
     }    
+    if (victimCacheCapacity <= 0){
+      fprintf(stderr, "Please specify victimCacheCapacity!\n");
+      exit(-1);
+    }
+    // Slots take the arena lines after the L1 blocks
+    this->victimBlockIds = std::vector<uint64_t>(victimCacheCapacity);
+    this->victimLine = std::vector<uint32_t>(victimCacheCapacity);
+    this->victimPrev = std::vector<uint32_t>(victimCacheCapacity);
+    this->victimNext = std::vector<uint32_t>(victimCacheCapacity);
+    for (int slot = victimCacheCapacity - 1; slot >= 0; --slot) {
+      this->victimLine[slot] = policy.blockNum + slot;
+      this->victimFree.push_back(slot);
+    }
+    this->victimHead = this->victimTail = UINT32_MAX;
+    this->victimIndex.reserve(victimCacheCapacity);
+    if (!this->tagOnly)
+      this->data.resize((size_t)(policy.blockNum + victimCacheCapacity) *
+                        policy.blockSize);
   }
 }
 #else
 Cache::Cache(MemoryManager *manager, Policy policy, Cache *lowerCache,
-             bool writeBack, bool writeAllocate) {
+             bool writeBack, bool writeAllocate, bool tagOnly) {
   this->referenceCounter = 0;
   this->memory = manager;
   this->policy = policy;
   this->lowerCache = lowerCache;
+  this->tagOnly = tagOnly;
   if (!this->isPolicyValid()) {
     fprintf(stderr, "Policy invalid!\n");
     exit(-1);
   }
+  if (lowerCache != nullptr && lowerCache->tagOnly != tagOnly) {
+    fprintf(stderr, "Tag-only and data caches cannot be mixed!\n");
+    exit(-1);
+  }
   this->initCache();
   this->statistics.numRead = 0;
   this->statistics.numWrite = 0;
@@ -71,71 +127,106 @@ Cache::Cache(MemoryManager *manager, Policy policy, Cache *lowerCache,
 }
 #endif
 
-bool Cache::inCache(uint32_t addr) {
+bool Cache::inCache(uint64_t addr) {
   return getBlockId(addr) != -1 ? true : false;
 }
 
-uint32_t Cache::getBlockId(uint32_t addr) {
-  uint32_t tag = this->getTag(addr);
+uint32_t Cache::getBlockId(uint64_t addr) {
+  uint64_t tag = this->getTag(addr);
   uint32_t id = this->getId(addr);
   // printf("0x%x 0x%x 0x%x\n", addr, tag, id);
   // iterate over the given set
-  for (uint32_t i = id * policy.associativity;
-       i < (id + 1) * policy.associativity; ++i) {
-    if (this->blocks[i].id != id) {
-      fprintf(stderr, "Inconsistent ID in block %d\n", i);
-      exit(-1);
-    }
-    if (this->blocks[i].valid && this->blocks[i].tag == tag) {
-      return i;
+  const uint64_t *setTags = &this->tags[id * policy.associativity];
+  const uint8_t *setFlags = &this->flags[id * policy.associativity];
+  for (uint32_t i = 0; i < policy.associativity; ++i) {
+    if ((setFlags[i] & VALID) && setTags[i] == tag) {
+      return id * policy.associativity + i;
     }
   }
-  // Victim Cache below
-  // fail first
-  if (this->ifUsingVictimCache){
-    bool ifVictimCacheHit = 0;
-    if (policy.associativity != 1){
-      fprintf(stderr, "Using Victim cache but policy.associativity != 1\n");
-      exit(-1);
-    }    
-    // Full associatity
-    const int victimCacheSize = victimCache.size();
-    for (size_t i = 0; i < victimCacheSize; i++)
-    {
-      // 访问队列的前端元素
-      Cache::Block frontBlock = victimCache.front();
-      victimCache.pop();
-      if (getGlobalUniqueBlockIDFromAddr(addr) == getGlobalUniqueBlockIDFromBlock(frontBlock)){
-        // if hit then add latency, if miss, then L1 miss, use L1 miss latency is ok because it assumes L2 and victim cache concurrently runs
-        this->statistics.totalCycles += this->victimCacheLatency;        
-        // Full associatity, if hit, swap
-        if (ifVictimCacheHit){
-          fprintf(stderr, "ERROR: hit 2 times in VictimCache：%d\n", i);
-          exit(-1);
-        }
-        victimCache.push(this->blocks[id]);
-        writeBlockToLowerLevel(this->blocks[id]);
-        this->blocks[id] = frontBlock;
-        ifVictimCacheHit = 1;
-        // printf("victimCache hit\n");
-      }else{
-        // other remain the same
-        victimCache.push(frontBlock);
+  return -1;
+}
+
+bool Cache::peek(uint64_t addr, uint8_t *buf, uint32_t len) {
+  bool cached = false;
+  uint32_t done = 0;
+  while (done < len) {
+    uint64_t cur = addr + done;
+    uint32_t offset = cur % this->policy.blockSize;
+    uint32_t chunk = std::min(this->policy.blockSize - offset, len - done);
+    for (Cache *level = this; level != nullptr; level = level->lowerCache) {
+      int blockId = level->getBlockId(cur);
+      if (blockId != -1 && !level->tagOnly) {
+        memcpy(buf + done,
+               level->getBlockData(blockId) + cur % level->policy.blockSize,
+               chunk);
+        cached = true;
+        break;
       }
     }
-    if (victimCache.size() != victimCacheSize){
-      fprintf(stderr, "ERROR: after swap, victimCache.size() != victimCacheSize\n");
-      exit(-1);
-    }
-    if (ifVictimCacheHit){
-      return id;
-    }    
+    done += chunk;
+  }
+  return cached;
+}
+
+uint8_t Cache::getByte(uint64_t addr, uint32_t *cycles) {
+  uint8_t val;
+  this->getBytes(addr, &val, 1, cycles);
+  return val;
+}
+
+void Cache::setByte(uint64_t addr, uint8_t val, uint32_t *cycles) {
+  this->setBytes(addr, &val, 1, cycles);
+}
+
+void Cache::getBytes(uint64_t addr, uint8_t *buf, uint32_t len,
+                     uint32_t *cycles) {
+  // Split the access at block boundaries, one lookup per touched block
+  uint32_t done = 0;
+  while (done < len) {
+    uint32_t chunk = this->policy.blockSize - this->getOffset(addr + done);
+    if (chunk > len - done)
+      chunk = len - done;
+#ifdef MEMORY_YYX
+    std::unique_lock<std::mutex> shared, core;
+    this->lockAccess(addr + done, false, shared, core);
+#endif
+    uint32_t chunkCycles = 0;
+    this->readFromBlock(addr + done, buf + done, chunk, &chunkCycles);
+    if (cycles) *cycles = done == 0 ? chunkCycles : *cycles + chunkCycles;
+    done += chunk;
   }
+}
 
-  return -1;
+void Cache::setBytes(uint64_t addr, const uint8_t *buf, uint32_t len,
+                     uint32_t *cycles) {
+  uint32_t done = 0;
+  while (done < len) {
+    uint32_t chunk = this->policy.blockSize - this->getOffset(addr + done);
+    if (chunk > len - done)
+      chunk = len - done;
+#ifdef MEMORY_YYX
+    std::unique_lock<std::mutex> shared, core;
+    this->lockAccess(addr + done, true, shared, core);
+#endif
+    uint32_t chunkCycles = 0;
+    this->writeToBlock(addr + done, buf + done, chunk, &chunkCycles);
+    if (cycles) *cycles = done == 0 ? chunkCycles : *cycles + chunkCycles;
+    done += chunk;
+  }
+}
+
+void Cache::fillLine(uint64_t addr, uint8_t *buf, uint32_t len,
+                     uint32_t *cycles) {
+  this->getBytes(addr, buf, len, cycles);
+}
+
+void Cache::writebackLine(uint64_t addr, const uint8_t *buf, uint32_t len,
+                          uint32_t *cycles) {
+  this->setBytes(addr, buf, len, cycles);
 }
 
-uint8_t Cache::getByte(uint32_t addr, uint32_t *cycles) {
+void Cache::readFromBlock(uint64_t addr, uint8_t *buf, uint32_t len,
+                          uint32_t *cycles) {
   this->referenceCounter++;
   this->statistics.numRead++;
 
@@ -145,33 +236,58 @@ uint8_t Cache::getByte(uint32_t addr, uint32_t *cycles) {
     uint32_t offset = this->getOffset(addr);
     this->statistics.numHit++;
     this->statistics.totalCycles += this->policy.hitLatency;
-    this->blocks[blockId].lastReference = this->referenceCounter;
+    this->lastReference[blockId] = this->referenceCounter;
 #ifdef MEMORY_YYX
-    if (RRIP == this->replacementType){
-      this->blocks[blockId].RRIPid = 0;
+    this->recordAccess(blockId);
+    this->updateReplacementPolicy(blockId, true);
+    if (this->isRRIP()){
+      this->RRIPid[blockId] = 0;
     }
 #endif        
     if (cycles) *cycles = this->policy.hitLatency;
-    return this->blocks[blockId].data[offset];
+#ifdef MEMORY_YYX
+    uint32_t coherenceCycles = this->serveCoherentRequest(blockId, addr);
+    if (cycles) *cycles += coherenceCycles;
+#endif
+    this->copyOut(blockId, offset, buf, len);
+    return;
   }
 
-  // Else, find the data in memory or other level of cache
+  // Else, find the data in the victim cache, memory or other level of cache
   this->statistics.numMiss++;
-  this->statistics.totalCycles += this->policy.missLatency;
-  this->loadBlockFromLowerLevel(addr, cycles);
+#ifdef MEMORY_YYX
+  if (this->ifUsingVictimCache && this->loadBlockFromVictimCache(addr, false)) {
+    this->statistics.totalCycles += this->policy.hitLatency;
+    if (cycles) *cycles = this->policy.hitLatency + this->victimCacheLatency;
+  } else
+#endif
+  {
+    this->statistics.totalCycles += this->policy.missLatency;
+#ifdef MEMORY_YYX
+    this->loadBlockFromLowerLevel(addr, cycles, this->requestExclusive);
+#else
+    this->loadBlockFromLowerLevel(addr, cycles);
+#endif
+  }
 
   // The block is in top level cache now, return directly
   if ((blockId = this->getBlockId(addr)) != -1) {
     uint32_t offset = this->getOffset(addr);
-    this->blocks[blockId].lastReference = this->referenceCounter;
-    return this->blocks[blockId].data[offset];
+    this->lastReference[blockId] = this->referenceCounter;
+#ifdef MEMORY_YYX
+    this->recordAccess(blockId);
+    uint32_t coherenceCycles = this->serveCoherentRequest(blockId, addr);
+    if (cycles) *cycles += coherenceCycles;
+#endif
+    this->copyOut(blockId, offset, buf, len);
   } else {
     fprintf(stderr, "Error: data not in top level cache!\n");
     exit(-1);
   }
 }
 
-void Cache::setByte(uint32_t addr, uint8_t val, uint32_t *cycles) {
+void Cache::writeToBlock(uint64_t addr, const uint8_t *buf, uint32_t len,
+                         uint32_t *cycles) {
   this->referenceCounter++;
   this->statistics.numWrite++;
 
@@ -181,37 +297,72 @@ void Cache::setByte(uint32_t addr, uint8_t val, uint32_t *cycles) {
     uint32_t offset = this->getOffset(addr);
     this->statistics.numHit++;
     this->statistics.totalCycles += this->policy.hitLatency;
-    this->blocks[blockId].modified = true;
-    this->blocks[blockId].lastReference = this->referenceCounter;
-    this->blocks[blockId].data[offset] = val;
     #ifdef MEMORY_YYX
+    // A shared copy has to invalidate the others first
+    uint32_t upgradeCycles = 0;
+    if (this->coreId >= 0 && !(this->flags[blockId] & WRITABLE))
+      upgradeCycles = this->acquireWritable(addr);
+    #endif
+    this->flags[blockId] |= MODIFIED;
+    this->lastReference[blockId] = this->referenceCounter;
+    this->copyIn(blockId, offset, buf, len);
+    #ifdef MEMORY_YYX
+    this->recordAccess(blockId);
+    this->updateReplacementPolicy(blockId, true);
     //RRIP
-    this->blocks[blockId].RRIPid = 0; 
+    if (this->isRRIP())
+      this->RRIPid[blockId] = 0; 
     this->updateLowerLevelAccordingToPolicy(blockId);
     #else
     if (!this->writeBack) {
-      this->writeBlockToLowerLevel(this->blocks[blockId]);
+      this->writeBlockToLowerLevel(blockId);
       this->statistics.totalCycles += this->policy.missLatency;
     }
     #endif
     if (cycles) *cycles = this->policy.hitLatency;
+    #ifdef MEMORY_YYX
+    if (cycles) *cycles += upgradeCycles;
+    #endif
     return;
   }
 
   // Else, load the data from cache
   // TODO: implement bypassing
   this->statistics.numMiss++;
-  this->statistics.totalCycles += this->policy.missLatency;
+  bool inVictimCache = false;
+#ifdef MEMORY_YYX
+  // A block found in the victim cache moves back to L1 even without write
+  // allocate
+  if (this->ifUsingVictimCache && this->loadBlockFromVictimCache(addr, true)) {
+    inVictimCache = true;
+    this->statistics.totalCycles += this->policy.hitLatency;
+    if (cycles) *cycles = this->policy.hitLatency + this->victimCacheLatency;
+  } else
+#endif
+    this->statistics.totalCycles += this->policy.missLatency;
 
-  if (this->writeAllocate) {
-    this->loadBlockFromLowerLevel(addr, cycles);
+  if (inVictimCache || this->writeAllocate) {
+    if (!inVictimCache)
+    #ifdef MEMORY_YYX
+      this->loadBlockFromLowerLevel(addr, cycles, true);
+    #else
+      this->loadBlockFromLowerLevel(addr, cycles);
+    #endif
 
     if ((blockId = this->getBlockId(addr)) != -1) {
       uint32_t offset = this->getOffset(addr);
-      this->blocks[blockId].modified = true;
-      this->blocks[blockId].lastReference = this->referenceCounter;
-      this->blocks[blockId].data[offset] = val;
     #ifdef MEMORY_YYX
+      // Blocks back from the victim cache come without write permission
+      if (this->coreId >= 0 && !(this->flags[blockId] & WRITABLE)) {
+        uint32_t upgradeCycles = this->acquireWritable(addr);
+        if (cycles) *cycles += upgradeCycles;
+      }
+    #endif
+      this->flags[blockId] |= MODIFIED;
+      this->lastReference[blockId] = this->referenceCounter;
+      this->copyIn(blockId, offset, buf, len);
+    #ifdef MEMORY_YYX
+      this->recordAccess(blockId);
       //RRIP done as read miss
       updateLowerLevelAccordingToPolicy(blockId);
     #endif      
@@ -222,9 +373,14 @@ void Cache::setByte(uint32_t addr, uint8_t val, uint32_t *cycles) {
     }
   } else {
     if (this->lowerCache == nullptr) {
-      this->memory->setByteNoCache(addr, val);
+      if (!this->tagOnly)
+        this->memory->setBytesNoCache(addr, buf, len);
+#ifdef MEMORY_YYX
+      if (this->dram)
+        this->dram->write(addr, this->currentCycle);
+#endif
     } else {
-      this->lowerCache->setByte(addr, val);
+      this->lowerCache->setBytes(addr, buf, len);
     }
   }
 }
@@ -239,11 +395,12 @@ void Cache::printInfo(bool verbose) {
   printf("Miss Latency: %d\n", this->policy.missLatency);
 
   if (verbose) {
-    for (int j = 0; j < this->blocks.size(); ++j) {
-      const Block &b = this->blocks[j];
-      printf("Block %d: tag 0x%x id %d %s %s (last ref %d)\n", j, b.tag, b.id,
-             b.valid ? "valid" : "invalid",
-             b.modified ? "modified" : "unmodified", b.lastReference);
+    for (uint32_t j = 0; j < this->policy.blockNum; ++j) {
+      printf("Block %d: tag 0x%llx id %d %s %s (last ref %d)\n", j,
+             (unsigned long long)this->tags[j], j / this->policy.associativity,
+             (this->flags[j] & VALID) ? "valid" : "invalid",
+             (this->flags[j] & MODIFIED) ? "modified" : "unmodified",
+             this->lastReference[j]);
       // printf("Data: ");
       // for (uint8_t d : b.data)
       // printf("%d ", d);
@@ -259,6 +416,25 @@ void Cache::printStatistics() {
   printf("Num Hit: %d\n", this->statistics.numHit);
   printf("Num Miss: %d\n", this->statistics.numMiss);
   printf("Total Cycles: %llu\n", this->statistics.totalCycles);
+#ifdef MEMORY_YYX
+  if (INCLUSIVE == this->inclusionType && this->upperCache)
+    printf("Back Invalidations: %d (%d filtered by presence)\n",
+           this->numBackInvalidation, this->numBackInvalidationFiltered);
+  if (DRRIP == this->replacementType)
+    printf("DRRIP PSEL: %d (%s)\n", this->psel,
+           this->psel > PSEL_MAX / 2 ? "BRRIP" : "SRRIP");
+  if (this->ifUsingVictimCache) {
+    printf("---------- VICTIM CACHE ----------\n");
+    printf("Capacity: %d blocks (%s)\n", this->victimCacheCapacity,
+           VICTIM_LRU == this->victimReplacementType ? "LRU" : "FIFO");
+    printf("Num Read: %d\n", this->victimStatistics.numRead);
+    printf("Num Write: %d\n", this->victimStatistics.numWrite);
+    printf("Num Hit: %d\n", this->victimStatistics.numHit);
+    printf("Num Miss: %d\n", this->victimStatistics.numMiss);
+    printf("Total Cycles: %llu\n",
+           (unsigned long long)this->victimStatistics.totalCycles);
+  }
+#endif
   if (this->lowerCache != nullptr) {
     printf("---------- LOWER CACHE ----------\n");
     this->lowerCache->printStatistics();
@@ -290,47 +466,74 @@ bool Cache::isPolicyValid() {
 }
 
 void Cache::initCache() {
-  this->blocks = std::vector<Block>(policy.blockNum);
-  for (uint32_t i = 0; i < this->blocks.size(); ++i) {
-    Block &b = this->blocks[i];
-    b.valid = false;
-    b.modified = false;
-    b.size = policy.blockSize;
-    b.tag = 0;
-    b.id = i / policy.associativity;
-    b.lastReference = 0;
-    b.data = std::vector<uint8_t>(b.size);
+  // One allocation per array, not per block
+  this->tags = std::vector<uint64_t>(policy.blockNum, 0);
+  this->flags = std::vector<uint8_t>(policy.blockNum, 0);
+  this->lastReference = std::vector<uint32_t>(policy.blockNum, 0);
 #ifdef MEMORY_YYX
-    b.RRIPid = (1<<policy.associativity)-1;
+  // Per block state of a policy or feature only exists when it is in use
+  if (this->isRRIP())
+    this->RRIPid = std::vector<uint8_t>(policy.blockNum, RRPV_MAX);
+  if (INCLUSIVE == this->inclusionType)
+    this->presence = std::vector<uint32_t>(policy.blockNum, 0);
+  this->brripCounter = 0;
+  this->psel = PSEL_MAX / 2;
+  if (BELADY == this->replacementType)
+    this->lastAccessIndex = std::vector<uint32_t>(policy.blockNum, 0);
 #endif    
+  // A tag-only cache only tracks metadata
+  if (!this->tagOnly) {
+    this->blockLine = std::vector<uint32_t>(policy.blockNum);
+    for (uint32_t i = 0; i < policy.blockNum; ++i)
+      this->blockLine[i] = i;
+    this->data =
+        std::vector<uint8_t>((size_t)policy.blockNum * policy.blockSize);
+    this->fillBuffer = std::vector<uint8_t>(policy.blockSize);
   }
 }
 
-void Cache::loadBlockFromLowerLevel(uint32_t addr, uint32_t *cycles) {
+void Cache::loadBlockFromLowerLevel(uint64_t addr, uint32_t *cycles,
+                                    bool exclusive) {
   uint32_t blockSize = this->policy.blockSize;
 
-  // Initialize new block from memory
-  Block b;
-  b.valid = true;
-  b.modified = false;
-  b.tag = this->getTag(addr);
-  b.id = this->getId(addr);
-  b.size = blockSize;
-  b.data = std::vector<uint8_t>(b.size);
-#ifdef MEMORY_YYX
-// RRIP
-  b.RRIPid = (1<<(this->policy.associativity))-2;
-  
-#endif  
+  // Fetch the new block from memory into the staging buffer, it is moved to
+  // its way once the replaced block has been written back
   uint32_t bits = this->log2i(blockSize);
-  uint32_t mask = ~((1 << bits) - 1);
-  uint32_t blockAddrBegin = addr & mask;
-  for (uint32_t i = blockAddrBegin; i < blockAddrBegin + blockSize; ++i) {
-    if (this->lowerCache == nullptr) {
-      b.data[i - blockAddrBegin] = this->memory->getByteNoCache(i);
-      if (cycles) *cycles = 100;
-    } else 
-      b.data[i - blockAddrBegin] = this->lowerCache->getByte(i, cycles);
+  uint64_t mask = ~(uint64_t)((1 << bits) - 1);
+  uint64_t blockAddrBegin = addr & mask;
+#ifdef MEMORY_YYX
+  bool grantExclusive = false;
+#endif
+  if (this->lowerCache == nullptr) {
+    if (!this->tagOnly)
+      this->memory->getBytesNoCache(blockAddrBegin, this->fillBuffer.data(),
+                                    blockSize);
+#ifdef MEMORY_YYX
+    uint32_t latency =
+        this->dram ? this->dram->read(blockAddrBegin, this->currentCycle) : 100;
+    if (cycles) *cycles = latency;
+#else
+    if (cycles) *cycles = 100;
+#endif
+  } else {
+#ifdef MEMORY_YYX
+    if (this->coreId >= 0) {
+      this->lowerCache->requestCore = this->coreId;
+      this->lowerCache->requestExclusive = exclusive;
+      this->lowerCache->currentPC = this->currentPC;
+      this->lowerCache->currentCycle = this->currentCycle;
+    }
+#endif
+    this->lowerCache->fillLine(blockAddrBegin, this->fillBuffer.data(),
+                               blockSize, cycles);
+#ifdef MEMORY_YYX
+    if (this->coreId >= 0) {
+      grantExclusive = this->lowerCache->grantExclusive;
+      this->lowerCache->requestCore = -1;
+      this->lowerCache->requestExclusive = false;
+      this->lowerCache->grantExclusive = false;
+    }
+#endif
   }
 #ifdef MEMORY_YYX
   if (EXCLUSIVE == this->inclusionType && this->lowerCache){
@@ -343,30 +546,61 @@ void Cache::loadBlockFromLowerLevel(uint32_t addr, uint32_t *cycles) {
   uint32_t blockIdBegin = id * this->policy.associativity;
   uint32_t blockIdEnd = (id + 1) * this->policy.associativity;
   uint32_t replaceId = this->getReplacementBlockId(blockIdBegin, blockIdEnd);
-  Block replaceBlock = this->blocks[replaceId];
+  bool replaceValid = this->flags[replaceId] & VALID;
+#ifdef MEMORY_YYX
+  // The private copies of the replaced block go first, dirty ones update it
+  // before its write back
+  if (replaceValid && !this->privateCaches.empty()) {
+    if (this->sharers[replaceId])
+      this->snoopSharers(replaceId, this->sharers[replaceId], true, true);
+    this->sharers[replaceId] = 0;
+    this->owned[replaceId] = 0;
+  }
+#endif
   // yyx comment: if writeThrough or no valid or no modified, just throw away
-  if (this->writeBack && replaceBlock.valid &&
-      replaceBlock.modified) { // write back to memory
-    this->writeBlockToLowerLevel(replaceBlock);
+  if (this->writeBack && replaceValid &&
+      (this->flags[replaceId] & MODIFIED)) { // write back to memory
+    this->writeBlockToLowerLevel(replaceId);
     this->statistics.totalCycles += this->policy.missLatency;
   }
 
   #ifdef MEMORY_YYX
-  // whenever valid be replaced, need to check
-  if (replaceBlock.valid && INCLUSIVE == this->inclusionType)
-    backInvalidation(this->upperCache, addr);
-  // victimCache
-  if (replaceBlock.valid && this->ifUsingVictimCache){
-    // FIFO
-    if (victimCache.size() == victimCacheCapacity){
-      victimCache.pop();
+  if (replaceValid && this->replacementPolicy)
+    this->replacementPolicy->onEvict(id, replaceId % this->policy.associativity);
+  // whenever valid be replaced, need to check, but only probe the upper
+  // level when it holds part of the block
+  if (replaceValid && INCLUSIVE == this->inclusionType && this->upperCache) {
+    if (this->presence[replaceId]) {
+      this->numBackInvalidation++;
+      this->upperCache->backInvalidation(this->getAddr(replaceId), blockSize);
+    } else {
+      this->numBackInvalidationFiltered++;
     }
-    victimCache.push(replaceBlock);
   }
-
+  if (INCLUSIVE == this->inclusionType)
+    this->presence[replaceId] = 0;
+  // victimCache keeps the block at this level, otherwise it leaves
+  if (replaceValid && this->ifUsingVictimCache)
+    this->insertVictim(replaceId);
+  else if (replaceValid && this->lowerCache)
+    this->lowerCache->updatePresence(this->getAddr(replaceId), blockSize,
+                                     false);
   #endif
 
-  this->blocks[replaceId] = b;
+  this->tags[replaceId] = this->getTag(addr);
+  this->flags[replaceId] = VALID;
+  if (!this->tagOnly)
+    memcpy(this->getBlockData(replaceId), this->fillBuffer.data(), blockSize);
+#ifdef MEMORY_YYX
+  if (grantExclusive)
+    this->flags[replaceId] |= WRITABLE;
+// RRIP
+  if (this->isRRIP())
+    this->RRIPid[replaceId] = this->getRRIPInsertion(id);
+  this->updateReplacementPolicy(replaceId, false);
+  if (this->lowerCache)
+    this->lowerCache->updatePresence(blockAddrBegin, blockSize, true);
+#endif  
 }
 
 uint32_t Cache::getReplacementBlockId(uint32_t begin, uint32_t end) {
@@ -377,63 +611,57 @@ uint32_t Cache::getReplacementBlockId(uint32_t begin, uint32_t end) {
   case LRU:{
     // Find invalid block first
     for (uint32_t i = begin; i < end; ++i) {
-      if (!this->blocks[i].valid){
+      if (!(this->flags[i] & VALID)){
         return i;
       }
     }
     // Otherwise use LRU
-    uint32_t min = this->blocks[begin].lastReference;
+    uint32_t min = this->lastReference[begin];
     for (uint32_t i = begin; i < end; ++i) {
-      if (this->blocks[i].lastReference < min) {
+      if (this->lastReference[i] < min) {
         resultId = i;
-        min = this->blocks[i].lastReference;
+        min = this->lastReference[i];
       }
     }
     break;
   }
-  case RRIP:{
-    // if RRIPid is (1<<associaty)-1 ,then is invalid or need to be evicted
-    uint32_t max_RRIPid = this->blocks[begin].RRIPid;
-    uint32_t max_index = begin;
-    const uint32_t FULLRRIPid = (1<<(this->policy.associativity))-1;
+  case RRIP:
+  case BRRIP:
+  case DRRIP:{
+    // Find invalid block first
     for (uint32_t i = begin; i < end; ++i) {
-      if (this->blocks[i].RRIPid < 0){
-        // robust
-        printf("this->blocks[i].RRIPid not initialized\n");
-        exit(-1);
+      if (!(this->flags[i] & VALID)){
+        return i;
       }
-      if (FULLRRIPid == this->blocks[i].RRIPid) {
+    }
+    // Evict the first block with a distant RRPV, if there is none age the
+    // whole set until one gets there (all increments at once)
+    uint8_t maxRRPV = this->RRIPid[begin];
+    for (uint32_t i = begin; i < end; ++i) {
+      if (this->RRIPid[i] > maxRRPV) {
         resultId = i;
-        return resultId;
-      }else if (this->blocks[i].RRIPid > max_RRIPid){
-        max_RRIPid = this->blocks[i].RRIPid;
-        max_index = i;
-      }else if (FULLRRIPid < this->blocks[i].RRIPid){
-        // Robust test
-        printf("FULLRRIPid < this->blocks[i].RRIPid\n");
-        exit(-1);
+        maxRRPV = this->RRIPid[i];
       }
     }
-    // no FULLRRIPid == this->blocks[i].RRIPid, add everyone's RRID with (FULLRRIPid - max_RRIPid)
-    uint32_t add_RRIP = FULLRRIPid - max_RRIPid;
-    resultId = max_index;
-    for (uint32_t i = begin; i < end; ++i) {
-      this->blocks[i].RRIPid += add_RRIP;
+    if (maxRRPV < RRPV_MAX) {
+      uint8_t age = RRPV_MAX - maxRRPV;
+      for (uint32_t i = begin; i < end; ++i)
+        this->RRIPid[i] += age;
     }
     break;
   }
   case BELADY:{
     // Find invalid block first
     for (uint32_t i = begin; i < end; ++i) {
-      if (!this->blocks[i].valid){
+      if (!(this->flags[i] & VALID)){
         return i;
       }
     }
     // Otherwise use BELADY
-    uint32_t nextAppearTime_t = getNextSameGlobalBlockIDTimeFromGlobalBlockID(getGlobalUniqueBlockIDFromBlock(this->blocks[begin]));
+    uint32_t nextAppearTime_t = getNextUse(begin);
     uint32_t max_t = nextAppearTime_t;
     for (uint32_t i = begin; i < end; ++i) {
-      nextAppearTime_t = getNextSameGlobalBlockIDTimeFromGlobalBlockID(getGlobalUniqueBlockIDFromBlock(this->blocks[i]));
+      nextAppearTime_t = getNextUse(i);
       if (nextAppearTime_t > max_t) {
         resultId = i;
         max_t = nextAppearTime_t;
@@ -442,6 +670,16 @@ uint32_t Cache::getReplacementBlockId(uint32_t begin, uint32_t end) {
     break;
   }
   default:
+    if (this->replacementPolicy) {
+      // Find invalid block first
+      for (uint32_t i = begin; i < end; ++i) {
+        if (!(this->flags[i] & VALID)){
+          return i;
+        }
+      }
+      return begin + this->replacementPolicy->getVictim(
+                         begin / this->policy.associativity);
+    }
     printf("ERROR: NO designated ReplacementPolicy\n");
     exit(-1);
     break;
@@ -450,17 +688,17 @@ uint32_t Cache::getReplacementBlockId(uint32_t begin, uint32_t end) {
 #else
   // Find invalid block first
   for (uint32_t i = begin; i < end; ++i) {
-    if (!this->blocks[i].valid)
+    if (!(this->flags[i] & VALID))
       return i;
   }
 
   // Otherwise use LRU
   uint32_t resultId = begin;
-  uint32_t min = this->blocks[begin].lastReference;
+  uint32_t min = this->lastReference[begin];
   for (uint32_t i = begin; i < end; ++i) {
-    if (this->blocks[i].lastReference < min) {
+    if (this->lastReference[i] < min) {
       resultId = i;
-      min = this->blocks[i].lastReference;
+      min = this->lastReference[i];
     }
   }
   return resultId;  
@@ -468,124 +706,645 @@ uint32_t Cache::getReplacementBlockId(uint32_t begin, uint32_t end) {
 
 }
 
-void Cache::writeBlockToLowerLevel(Cache::Block &b) {
-  uint32_t addrBegin = this->getAddr(b);
+void Cache::writeBlockToLowerLevel(uint32_t blockId) {
+  uint64_t addrBegin = this->getAddr(blockId);
   if (this->lowerCache == nullptr) {
-    for (uint32_t i = 0; i < b.size; ++i) {
-      this->memory->setByteNoCache(addrBegin + i, b.data[i]);
-    }
+    if (!this->tagOnly)
+      this->memory->setBytesNoCache(addrBegin, this->getBlockData(blockId),
+                                    this->policy.blockSize);
+#ifdef MEMORY_YYX
+    if (this->dram)
+      this->dram->write(addrBegin, this->currentCycle);
+#endif
   } else {
-    for (uint32_t i = 0; i < b.size; ++i) {
-      this->lowerCache->setByte(addrBegin + i, b.data[i]);
-    }
+#ifdef MEMORY_YYX
+    this->lowerCache->accessHint = this->getAccessHint(blockId);
+#endif
+    this->lowerCache->writebackLine(addrBegin, this->getBlockData(blockId),
+                                    this->policy.blockSize);
+#ifdef MEMORY_YYX
+    this->lowerCache->accessHint = MAXNEXTAPPEARTIME;
+#endif
   }
 }
 
 #ifdef MEMORY_YYX
-void Cache::backInvalidation(Cache *cache, uint32_t addr){
-  if (nullptr == cache) return;
-  // If in cache, return directly
-  int blockId = this->getBlockId(addr);
-  if (-1 == blockId)
+// The lower level evicts [addr, addr + len), drop the blocks overlapping it
+// here and above. Inclusive levels forward every write down (see
+// updateLowerLevelAccordingToPolicy), so no data is lost.
+void Cache::backInvalidation(uint64_t addr, uint32_t len){
+  uint32_t blockSize = this->policy.blockSize;
+  uint64_t end = (uint64_t)addr + len;
+  uint64_t begin = addr & ~(uint64_t)(blockSize - 1);
+  for (uint64_t a = begin; a < end; a += blockSize) {
+    int blockId = this->getBlockId(a);
+    if (-1 != blockId) {
+      // recurse
+      if (INCLUSIVE == this->inclusionType) {
+        if (this->presence[blockId] && this->upperCache) {
+          this->numBackInvalidation++;
+          this->upperCache->backInvalidation(a, blockSize);
+        }
+        this->presence[blockId] = 0;
+      }
+      this->flags[blockId] &= ~VALID;
+      continue;
+    }
+    if (this->ifUsingVictimCache)
+      this->removeVictim(a);
+  }
+}
+
+// The upper level filled (present) or evicted a block covering
+// [addr, addr + len), count it on the blocks overlapping it
+void Cache::updatePresence(uint64_t addr, uint32_t len, bool present){
+  if (INCLUSIVE != this->inclusionType)
     return;
-  this->blocks[blockId].valid = false;
-  // recurse
-  backInvalidation(this->upperCache, addr);
+  uint32_t blockSize = this->policy.blockSize;
+  uint64_t end = (uint64_t)addr + len;
+  uint64_t begin = addr & ~(uint64_t)(blockSize - 1);
+  for (uint64_t a = begin; a < end; a += blockSize) {
+    int blockId = this->getBlockId(a);
+    if (-1 == blockId)
+      continue;
+    if (present)
+      this->presence[blockId]++;
+    else if (this->presence[blockId] > 0)
+      this->presence[blockId]--;
+  }
 }
 
-void Cache::exclusiveInvalidation(uint32_t addr){
+void Cache::exclusiveInvalidation(uint64_t addr){
   int blockId = this->getBlockId(addr);
   if (-1 == blockId)
     return;
-  this->blocks[blockId].valid = false;
+  this->flags[blockId] &= ~VALID;
 }
 
 void Cache::setUpperCache(Cache *upperCache){
   this->upperCache = upperCache;
 }
 
-void Cache::writeBlockToLowerLevelWithoutMemory(Cache::Block &b) {
-  uint32_t addrBegin = this->getAddr(b);
-  if (this->lowerCache != nullptr) {
-    for (uint32_t i = 0; i < b.size; ++i) {
-      this->lowerCache->setByte(addrBegin + i, b.data[i]);
+bool Cache::isRRIP(){
+  return RRIP == this->replacementType || BRRIP == this->replacementType ||
+         DRRIP == this->replacementType;
+}
+
+// Complement-select leaders: the sets are cut into DUEL_LEADER_SETS regions,
+// region r leads SRRIP with its r-th set (mod region size) and BRRIP with the
+// mirrored one. Regions hold at least 4 sets so that followers remain, with
+// fewer than 4 sets every set follows PSEL, which then stays at SRRIP
+int Cache::getDuelingSetType(uint32_t setId){
+  uint32_t setCount = this->policy.blockNum / this->policy.associativity;
+  uint32_t leaders = std::min(DUEL_LEADER_SETS, setCount / 4);
+  if (leaders == 0)
+    return FOLLOWER_SET;
+  uint32_t region = setCount / leaders;
+  uint32_t offset = setId % region;
+  uint32_t leader = (setId / region) % region;
+  if (offset == leader)
+    return SRRIP_LEADER_SET;
+  if (offset == region - 1 - leader)
+    return BRRIP_LEADER_SET;
+  return FOLLOWER_SET;
+}
+
+// RRPV of a block filled into the set, every fill is a miss of the set
+uint8_t Cache::getRRIPInsertion(uint32_t setId){
+  bool bimodal = false;
+  if (BRRIP == this->replacementType) {
+    bimodal = true;
+  } else if (DRRIP == this->replacementType) {
+    switch (this->getDuelingSetType(setId)) {
+    case SRRIP_LEADER_SET:
+      if (this->psel < PSEL_MAX)
+        this->psel++;
+      break;
+    case BRRIP_LEADER_SET:
+      if (this->psel > 0)
+        this->psel--;
+      bimodal = true;
+      break;
+    default:
+      // SRRIP leaders missing more push PSEL up, towards BRRIP
+      bimodal = this->psel > PSEL_MAX / 2;
+      break;
+    }
+  }
+  if (bimodal && ++this->brripCounter % BRRIP_EPSILON != 0)
+    return RRPV_MAX;
+  return RRPV_MAX - 1;
+}
+
+void Cache::setCurrentPC(uint64_t pc){
+  this->currentPC = pc;
+  // A shared level gets the PC with each request of a private level
+  if (this->lowerCache && this->lowerCache->privateCaches.empty())
+    this->lowerCache->setCurrentPC(pc);
+}
+
+void Cache::setCurrentCycle(uint64_t cycle){
+  this->currentCycle = cycle;
+  if (this->lowerCache && this->lowerCache->privateCaches.empty())
+    this->lowerCache->setCurrentCycle(cycle);
+}
+
+void Cache::setDram(DramController *dram){
+  if (dram && this->lowerCache) {
+    fprintf(stderr, "Only the last level cache talks to DRAM\n");
+    exit(-1);
+  }
+  this->dram = dram;
+}
+
+void Cache::updateReplacementPolicy(uint32_t blockId, bool hit){
+  if (!this->replacementPolicy)
+    return;
+  uint32_t associativity = this->policy.associativity;
+  // Policies only hash the block address and PC, their low bits will do
+  this->replacementPolicy->onAccess(
+      blockId / associativity, blockId % associativity,
+      (uint32_t)getGlobalUniqueBlockIDFromBlock(blockId),
+      (uint32_t)this->currentPC, hit);
+}
+
+void Cache::setVictimReplacementType(int victimReplacementType){
+  this->victimReplacementType = victimReplacementType;
+}
+
+// On an L1 miss, move the block from the victim cache back to its set, the
+// replaced block takes the victim's slot. Only line numbers are swapped.
+bool Cache::loadBlockFromVictimCache(uint64_t addr, bool isWrite){
+  if (isWrite)
+    this->victimStatistics.numWrite++;
+  else
+    this->victimStatistics.numRead++;
+  auto it = this->victimIndex.find(getGlobalUniqueBlockIDFromAddr(addr));
+  if (it == this->victimIndex.end()) {
+    this->victimStatistics.numMiss++;
+    return false;
+  }
+  uint32_t slot = it->second;
+  this->victimIndex.erase(it);
+  this->victimStatistics.numHit++;
+  this->victimStatistics.totalCycles += this->victimCacheLatency;
+
+  uint32_t id = this->getId(addr);
+  uint32_t replaceId = this->getReplacementBlockId(
+      id * this->policy.associativity, (id + 1) * this->policy.associativity);
+  bool replaceValid = this->flags[replaceId] & VALID;
+  if (this->writeBack && replaceValid && (this->flags[replaceId] & MODIFIED)) {
+    this->writeBlockToLowerLevel(replaceId);
+    this->statistics.totalCycles += this->policy.missLatency;
+  }
+  if (!this->tagOnly)
+    std::swap(this->blockLine[replaceId], this->victimLine[slot]);
+  if (replaceValid) {
+    // FIFO keeps the slot's place, LRU makes it the newest entry
+    uint64_t globalBlockId = getGlobalUniqueBlockIDFromBlock(replaceId);
+    this->victimBlockIds[slot] = globalBlockId;
+    this->victimIndex[globalBlockId] = slot;
+    if (VICTIM_LRU == this->victimReplacementType) {
+      this->unlinkVictim(slot);
+      this->appendVictim(slot);
+    }
+  } else {
+    this->unlinkVictim(slot);
+    this->victimFree.push_back(slot);
+  }
+  if (replaceValid && this->replacementPolicy)
+    this->replacementPolicy->onEvict(id, replaceId % this->policy.associativity);
+  this->tags[replaceId] = this->getTag(addr);
+  this->flags[replaceId] = VALID;
+  if (this->isRRIP())
+    this->RRIPid[replaceId] = this->getRRIPInsertion(id);
+  this->updateReplacementPolicy(replaceId, false);
+  return true;
+}
+
+// Keep a block evicted from L1, dropping the oldest entry when full
+void Cache::insertVictim(uint32_t blockId){
+  uint32_t slot;
+  if (this->victimFree.empty()) {
+    slot = this->victimHead;
+    this->unlinkVictim(slot);
+    this->victimIndex.erase(this->victimBlockIds[slot]);
+    // The dropped block leaves this level
+    if (this->lowerCache)
+      this->lowerCache->updatePresence(
+          this->victimBlockIds[slot] << this->log2i(this->policy.blockSize),
+          this->policy.blockSize, false);
+  } else {
+    slot = this->victimFree.back();
+    this->victimFree.pop_back();
+  }
+  uint64_t globalBlockId = getGlobalUniqueBlockIDFromBlock(blockId);
+  this->victimBlockIds[slot] = globalBlockId;
+  this->victimIndex[globalBlockId] = slot;
+  // The block's line moves to the slot, the block gets the slot's old line
+  if (!this->tagOnly)
+    std::swap(this->blockLine[blockId], this->victimLine[slot]);
+  this->appendVictim(slot);
+}
+
+// Drop the victim buffer entry of the block at addr, if any
+bool Cache::removeVictim(uint64_t addr){
+  auto it = this->victimIndex.find(getGlobalUniqueBlockIDFromAddr(addr));
+  if (it == this->victimIndex.end())
+    return false;
+  this->unlinkVictim(it->second);
+  this->victimFree.push_back(it->second);
+  this->victimIndex.erase(it);
+  return true;
+}
+
+void Cache::unlinkVictim(uint32_t slot){
+  uint32_t prev = this->victimPrev[slot], next = this->victimNext[slot];
+  if (prev != UINT32_MAX)
+    this->victimNext[prev] = next;
+  else
+    this->victimHead = next;
+  if (next != UINT32_MAX)
+    this->victimPrev[next] = prev;
+  else
+    this->victimTail = prev;
+}
+
+void Cache::appendVictim(uint32_t slot){
+  this->victimPrev[slot] = this->victimTail;
+  this->victimNext[slot] = UINT32_MAX;
+  if (this->victimTail != UINT32_MAX)
+    this->victimNext[this->victimTail] = slot;
+  else
+    this->victimHead = slot;
+  this->victimTail = slot;
+}
+
+void Cache::enableDirectory(const std::vector<Cache *> &privateCaches){
+  if (privateCaches.size() > 32) {
+    fprintf(stderr, "A directory supports up to 32 cores\n");
+    exit(-1);
+  }
+  for (uint32_t core = 0; core < privateCaches.size(); ++core) {
+    if (privateCaches[core]->lowerCache != this) {
+      fprintf(stderr, "Private caches of core %d are not above the shared cache\n",
+              core);
+      exit(-1);
+    }
+    for (Cache *c = privateCaches[core]; c; c = c->upperCache) {
+      if (NINE != c->inclusionType ||
+          c->policy.blockSize != this->policy.blockSize) {
+        fprintf(stderr, "Private caches must be NINE with the block size of the shared cache\n");
+        exit(-1);
+      }
+      c->coreId = core;
+    }
+  }
+  this->privateCaches = privateCaches;
+  this->sharers = std::vector<uint32_t>(this->policy.blockNum, 0);
+  this->owned = std::vector<uint8_t>(this->policy.blockNum, 0);
+  this->invalidatedBlocks =
+      std::vector<std::unordered_set<uint64_t>>(privateCaches.size());
+}
+
+// The block serves a fill of the upper level of requestCore. The directory
+// snoops the other sharers, a private level asks for write permission itself
+// when the fill wants it. Returns the added latency.
+uint32_t Cache::serveCoherentRequest(uint32_t blockId, uint64_t addr){
+  if (this->requestCore < 0)
+    return 0;
+  if (this->privateCaches.empty()) {
+    uint32_t cycles = 0;
+    if (this->requestExclusive && !(this->flags[blockId] & WRITABLE))
+      cycles = this->acquireWritable(addr);
+    this->grantExclusive = this->flags[blockId] & WRITABLE;
+    return cycles;
+  }
+
+  uint32_t core = this->requestCore;
+  uint32_t bit = 1u << core;
+  if (this->invalidatedBlocks[core].erase(
+          getGlobalUniqueBlockIDFromBlock(blockId)))
+    this->coherenceStatistics.numCoherenceMiss++;
+  uint32_t others = this->sharers[blockId] & ~bit;
+  uint32_t cycles = 0;
+  if (this->requestExclusive) {
+    if (others)
+      cycles = this->snoopSharers(blockId, others, true, false);
+    this->sharers[blockId] = bit;
+  } else {
+    // Only an owner may hold a newer copy
+    if (this->owned[blockId] && others)
+      cycles = this->snoopSharers(blockId, others, false, false);
+    this->sharers[blockId] |= bit;
+  }
+  this->owned[blockId] = this->sharers[blockId] == bit;
+  this->grantExclusive = this->owned[blockId];
+  return cycles;
+}
+
+// Write permission for a block held without it, asked down to the shared
+// level which invalidates the other copies
+uint32_t Cache::acquireWritable(uint64_t addr){
+  int blockId = this->getBlockId(addr);
+  if (-1 != blockId && (this->flags[blockId] & WRITABLE))
+    return 0;
+  uint32_t cycles = 0;
+  if (this->lowerCache && this->lowerCache->coreId >= 0)
+    cycles = this->lowerCache->acquireWritable(addr);
+  else if (this->lowerCache)
+    cycles = this->lowerCache->coherentUpgrade(this->coreId, addr);
+  if (-1 != blockId)
+    this->flags[blockId] |= WRITABLE;
+  return cycles;
+}
+
+uint32_t Cache::coherentUpgrade(int core, uint64_t addr){
+  int blockId = this->getBlockId(addr);
+  if (-1 == blockId || this->privateCaches.empty())
+    return 0;
+  this->coherenceStatistics.numUpgrade++;
+  this->coherenceStatistics.totalCycles += this->policy.hitLatency;
+  uint32_t cycles = this->policy.hitLatency;
+  uint32_t bit = 1u << core;
+  uint32_t others = this->sharers[blockId] & ~bit;
+  if (others)
+    cycles += this->snoopSharers(blockId, others, true, false);
+  this->sharers[blockId] = bit;
+  this->owned[blockId] = 1;
+  return cycles;
+}
+
+// Invalidate or downgrade the copies of the cores in mask, dirty data is
+// flushed into the block. byEviction: the block leaves this cache. Parallel
+// runs snoop an owner at once as its copy may be newer than the block, and
+// only queue the snoops of shared copies, which are clean and cost the
+// requester nothing.
+uint32_t Cache::snoopSharers(uint32_t blockId, uint32_t mask, bool invalidate,
+                             bool byEviction){
+  SnoopRequest request;
+  request.addr = this->getAddr(blockId);
+  request.invalidate = invalidate;
+  request.byEviction = byEviction;
+  uint32_t cycles = 0;
+  for (uint32_t core = 0; core < this->privateCaches.size(); ++core) {
+    if (!(mask & (1u << core)))
+      continue;
+    if (this->parallel && !this->owned[blockId]) {
+      this->snoopQueues[core]->push(request);
+      continue;
+    }
+    Cache *privateCache = this->privateCaches[core];
+    // The requesting core already holds its own lock
+    std::unique_lock<std::mutex> guard;
+    if (this->parallel && (int)core != this->lockingCore)
+      guard = std::unique_lock<std::mutex>(*this->coreLocks[core]);
+    int result = privateCache->snoop(request.addr, invalidate,
+                                     this->getBlockData(blockId));
+    // The core may have dropped its copy silently
+    if (!result)
+      continue;
+    cycles += privateCache->policy.hitLatency;
+    this->recordSnoop(core, request.addr, request, result);
+    if (result & SNOOP_DIRTY)
+      this->flags[blockId] |= MODIFIED;
+  }
+  return cycles;
+}
+
+void Cache::recordSnoop(int core, uint64_t addr, const SnoopRequest &request,
+                        int result){
+  this->coherenceStatistics.totalCycles +=
+      this->privateCaches[core]->policy.hitLatency;
+  if (request.byEviction) {
+    this->coherenceStatistics.numEvictInvalidation++;
+  } else if (request.invalidate) {
+    this->coherenceStatistics.numInvalidation++;
+    this->invalidatedBlocks[core].insert(
+        getGlobalUniqueBlockIDFromAddr(addr));
+  } else {
+    this->coherenceStatistics.numDowngrade++;
+  }
+  if (result & SNOOP_DIRTY)
+    this->coherenceStatistics.numFlush++;
+}
+
+void Cache::enableParallelSnoops(){
+  this->parallel = true;
+  this->snoopBuffer = std::vector<uint8_t>(this->policy.blockSize);
+  this->snoopQueues.clear();
+  this->coreLocks.clear();
+  for (uint32_t core = 0; core < this->privateCaches.size(); ++core) {
+    this->snoopQueues.emplace_back(new SnoopQueue());
+    this->coreLocks.emplace_back(new std::mutex());
+    for (Cache *level = this->privateCaches[core]; level != nullptr;
+         level = level->upperCache) {
+      level->sharedLevel = this;
+      level->coreLock = this->coreLocks[core].get();
+    }
+  }
+}
+
+// Apply the snoops queued for core on its private caches, flushed data goes
+// to the block if this cache still holds it, to memory otherwise
+void Cache::drainSnoops(int core){
+  // Other cores may snoop the private caches directly under the lock
+  std::lock_guard<std::mutex> guard(this->sharedLock);
+  this->applySnoops(core);
+}
+
+// drainSnoops() with sharedLock held
+void Cache::applySnoops(int core){
+  Cache *privateCache = this->privateCaches[core];
+  uint8_t *buf = this->snoopBuffer.data();
+  SnoopRequest request;
+  while (this->snoopQueues[core]->pop(request)) {
+    int result = privateCache->snoop(request.addr, request.invalidate, buf);
+    if (!result)
+      continue;
+    this->recordSnoop(core, request.addr, request, result);
+    if (!(result & SNOOP_DIRTY) || this->tagOnly)
+      continue;
+    int blockId = this->getBlockId(request.addr);
+    if (-1 != blockId) {
+      memcpy(this->getBlockData(blockId), buf, this->policy.blockSize);
+      this->flags[blockId] |= MODIFIED;
+    } else {
+      this->memory->setBytesNoCache(request.addr, buf,
+                                    this->policy.blockSize);
+      if (this->dram)
+        this->dram->write(request.addr, this->currentCycle);
+    }
+  }
+}
+
+// Locks of an access to the top private level of a core in a parallel run,
+// none otherwise. A hit stays in this cache and holds only the core's lock,
+// anything else may reach the shared level and holds its lock as well for
+// the whole access. The shared level's lock always comes first, holding it
+// the shared level snoops the private caches of an owner directly. The
+// core's queued snoops are applied first, a copy the directory no longer
+// lists must not serve a fill or take write permission.
+void Cache::lockAccess(uint64_t addr, bool write,
+                       std::unique_lock<std::mutex> &shared,
+                       std::unique_lock<std::mutex> &core){
+  if (this->sharedLevel == nullptr || this->upperCache)
+    return;
+  core = std::unique_lock<std::mutex>(*this->coreLock);
+  int blockId = this->getBlockId(addr);
+  if (-1 != blockId &&
+      (!write || (this->writeBack && (this->flags[blockId] & WRITABLE))))
+    return;
+  core.unlock();
+  shared = std::unique_lock<std::mutex>(this->sharedLevel->sharedLock);
+  core.lock();
+  this->sharedLevel->lockingCore = this->coreId;
+  this->sharedLevel->applySnoops(this->coreId);
+}
+
+// Snoop of the private levels from this one up. The newest dirty copy is
+// copied to data, lower levels keeping a downgraded copy take it too.
+int Cache::snoop(uint64_t addr, bool invalidate, uint8_t *data){
+  int upper = 0;
+  if (this->upperCache)
+    upper = this->upperCache->snoop(addr, invalidate, data);
+  int result = 0;
+  int blockId = this->getBlockId(addr);
+  if (-1 != blockId) {
+    result |= SNOOP_HIT;
+    bool copy = !this->tagOnly && data;
+    if (upper & SNOOP_DIRTY) {
+      if (copy && !invalidate)
+        memcpy(this->getBlockData(blockId), data, this->policy.blockSize);
+    } else if (this->flags[blockId] & MODIFIED) {
+      result |= SNOOP_DIRTY;
+      if (copy)
+        memcpy(data, this->getBlockData(blockId), this->policy.blockSize);
     }
+    if (invalidate)
+      this->flags[blockId] = 0;
+    else
+      this->flags[blockId] &= ~(WRITABLE | MODIFIED);
+  } else if (invalidate && this->ifUsingVictimCache && this->removeVictim(addr)) {
+    result |= SNOOP_HIT;
   }
+  return result | upper;
 }
 
-void Cache::writeBlockToMemory(Cache::Block &b) {
-  uint32_t addrBegin = this->getAddr(b);
-  for (uint32_t i = 0; i < b.size; ++i) {
-    this->memory->setByteNoCache(addrBegin + i, b.data[i]);
+void Cache::printCoherenceStatistics(){
+  printf("---------- COHERENCE ----------\n");
+  printf("Cores: %d\n", (int)this->privateCaches.size());
+  printf("Coherence Misses: %d\n", this->coherenceStatistics.numCoherenceMiss);
+  printf("Invalidations: %d\n", this->coherenceStatistics.numInvalidation);
+  printf("Upgrades: %d\n", this->coherenceStatistics.numUpgrade);
+  printf("Downgrades: %d\n", this->coherenceStatistics.numDowngrade);
+  printf("Flushes: %d\n", this->coherenceStatistics.numFlush);
+  printf("Eviction Invalidations: %d\n",
+         this->coherenceStatistics.numEvictInvalidation);
+  printf("Total Cycles: %llu\n",
+         (unsigned long long)this->coherenceStatistics.totalCycles);
+}
+
+void Cache::writeBlockToLowerLevelWithoutMemory(uint32_t blockId) {
+  uint64_t addrBegin = this->getAddr(blockId);
+  if (this->lowerCache != nullptr) {
+    this->lowerCache->accessHint = this->getAccessHint(blockId);
+    this->lowerCache->writebackLine(addrBegin, this->getBlockData(blockId),
+                                    this->policy.blockSize);
+    this->lowerCache->accessHint = MAXNEXTAPPEARTIME;
   }
 }
 
+void Cache::writeBlockToMemory(uint32_t blockId) {
+  uint64_t addrBegin = this->getAddr(blockId);
+  // Skips the lower levels, but not the DRAM behind the last one
+  Cache *lastLevel = this;
+  while (lastLevel->lowerCache)
+    lastLevel = lastLevel->lowerCache;
+  if (lastLevel->dram)
+    lastLevel->dram->write(addrBegin, this->currentCycle);
+  if (this->tagOnly)
+    return;
+  this->memory->setBytesNoCache(addrBegin, this->getBlockData(blockId),
+                                this->policy.blockSize);
+}
+
 void Cache::updateLowerLevelAccordingToPolicy(int blockId) {
     if (!this->writeBack) {
       if (EXCLUSIVE == this->inclusionType){
         // just write memory
-        this->writeBlockToMemory(this->blocks[blockId]);
+        this->writeBlockToMemory(blockId);
       }else{
-        this->writeBlockToLowerLevel(this->blocks[blockId]);
+        this->writeBlockToLowerLevel(blockId);
       }
       this->statistics.totalCycles += this->policy.missLatency;    
     }else if(INCLUSIVE == this->inclusionType){
     // writeback but inclusive, need to write down until last level of cache
     // in this case, high level must have this cache line since inclusive; so will always go to this code in every level
-      this->writeBlockToLowerLevelWithoutMemory(this->blocks[blockId]);
+      this->writeBlockToLowerLevelWithoutMemory(blockId);
       this->statistics.totalCycles += this->policy.missLatency;
     }
 }
 
-void Cache::preInputAddrGlobalBlockIDForBelady(const char * traceFilePath){
-  // Read and execute trace in cache-trace/ folder
-  std::ifstream trace(traceFilePath);
-  if (!trace.is_open()) {
-    printf("Unable to open file %s\n", traceFilePath);
-    exit(-1);
+void Cache::preInputAddrGlobalBlockIDForBelady(const MemoryTrace &trace){
+  // Levels with the same block size see the same next uses
+  if (this->upperCache && this->upperCache->nextUse &&
+      this->upperCache->policy.blockSize == this->policy.blockSize) {
+    this->nextUse = this->upperCache->nextUse;
+    return;
   }
+  // One pass over the trace, each access patches the entry of the previous
+  // access to its block
+  std::vector<uint32_t> *next = new std::vector<uint32_t>();
+  next->reserve(trace.size());
+  std::unordered_map<uint64_t, uint32_t> lastIndex;
+  uint32_t offsetBits = log2i(policy.blockSize);
+  MemoryTrace::Cursor cursor = trace.cursor();
+  MemoryTrace::Access access;
+  while (cursor.read(access)) {
+    uint32_t index = next->size();
+    next->push_back(MAXNEXTAPPEARTIME);
+    auto it = lastIndex.emplace(access.addr >> offsetBits, index);
+    if (!it.second) {
+      (*next)[it.first->second] = index;
+      it.first->second = index;
+    }
+  }
+  this->nextUse.reset(next);
+}
 
-  char type; //'r' for read, 'w' for write
-  uint32_t addr;
-  uint32_t counter = 0; // time after may start at 1 the same as referenceCounter
-  while (trace >> type >> std::hex >> addr) {
-    counter++;
-    uint32_t globalBlockID = this->getGlobalUniqueBlockIDFromAddr(addr);
-    this->globalBlockID2Times[globalBlockID].push_back(counter);
-  }  
+void Cache::updateGlobalBlockIDCurrentTime(uint64_t addr){
+  this->beladyTime++;
 }
 
-void Cache::updateGlobalBlockIDCurrentTime(uint32_t addr){
-  uint32_t globalBlockID = this->getGlobalUniqueBlockIDFromAddr(addr);
-  int currentOrder = 0;
-  if (!globalBlockIDCurrentOrder.count(globalBlockID)){
-    // then default globalBlockIDCurrentOrder[addr] as 0
-    currentOrder = 0;
-  }else{
-    currentOrder = globalBlockIDCurrentOrder[globalBlockID]+1;
-  }
-  globalBlockIDCurrentOrder[globalBlockID] = currentOrder;
-  // printf("updateGlobalBlockIDCurrentTime globalBlockIDCurrentOrder[%u] = %d of addr:%0x\n", globalBlockID, currentOrder, addr);
-}  
+// Record the trace access that touches the block, the block written back by
+// the upper level keeps the index given with the write back
+void Cache::recordAccess(uint32_t blockId){
+  if (BELADY != this->replacementType)
+    return;
+  this->lastAccessIndex[blockId] = this->accessHint != MAXNEXTAPPEARTIME
+                                       ? this->accessHint
+                                       : this->beladyTime;
+}
 
-uint32_t Cache::getNextSameGlobalBlockIDTimeFromGlobalBlockID(uint32_t globalBlockID){
-  int currentOrder = 0;
-  if (!globalBlockIDCurrentOrder.count(globalBlockID)){
-    printf("ERROR: no possible that !globalBlockIDCurrentOrder.count(globalBlockID:%d) of addr: %0x, \
-    please check if you have updateGlobalBlockIDCurrentTime() before doing mem operation\n", globalBlockID);
-    exit(-1);
-  }else{
-    currentOrder = globalBlockIDCurrentOrder[globalBlockID];
-  }
-  int nextOrder = currentOrder+1;
-  if (nextOrder < globalBlockID2Times[globalBlockID].size()){
-    return globalBlockID2Times[globalBlockID][nextOrder];
-  }else if (globalBlockID2Times[globalBlockID].size() == nextOrder){
-    return MAXNEXTAPPEARTIME;
-  }else{
-    printf("unable to appear that globalBlockID2Times[globalBlockID].size() < nextOrder");
+uint32_t Cache::getAccessHint(uint32_t blockId){
+  return BELADY == this->replacementType ? this->lastAccessIndex[blockId]
+                                         : MAXNEXTAPPEARTIME;
+}
+
+// Next trace access to the block after the current one, following the chain
+// past accesses served by the upper level
+uint32_t Cache::getNextUse(uint32_t blockId){
+  if (!this->nextUse) {
+    printf("ERROR: BELADY needs preInputAddrGlobalBlockIDForBelady() before doing mem operation\n");
     exit(-1);
   }
+  const std::vector<uint32_t> &next = *this->nextUse;
+  uint32_t index = this->lastAccessIndex[blockId];
+  while (next[index] != MAXNEXTAPPEARTIME && next[index] <= this->beladyTime)
+    index = next[index];
+  this->lastAccessIndex[blockId] = index;
+  return next[index];
 }  
 #endif
 
@@ -604,42 +1363,62 @@ uint32_t Cache::log2i(uint32_t val) {
   return ret;
 }
 
-uint32_t Cache::getTag(uint32_t addr) {
+uint64_t Cache::getTag(uint64_t addr) {
   uint32_t offsetBits = log2i(policy.blockSize);
   uint32_t idBits = log2i(policy.blockNum / policy.associativity);
-  uint32_t mask = (1 << (32 - offsetBits - idBits)) - 1;
-  return (addr >> (offsetBits + idBits)) & mask;
+  return addr >> (offsetBits + idBits);
 }
 
-uint32_t Cache::getId(uint32_t addr) {
+uint32_t Cache::getId(uint64_t addr) {
   uint32_t offsetBits = log2i(policy.blockSize);
   uint32_t idBits = log2i(policy.blockNum / policy.associativity);
   uint32_t mask = (1 << idBits) - 1;
   return (addr >> offsetBits) & mask;
 }
 
-uint32_t Cache::getOffset(uint32_t addr) {
+uint32_t Cache::getOffset(uint64_t addr) {
   uint32_t bits = log2i(policy.blockSize);
   uint32_t mask = (1 << bits) - 1;
   return addr & mask;
 }
 
-uint32_t Cache::getAddr(Cache::Block &b) {
+uint64_t Cache::getAddr(uint32_t blockId) {
   uint32_t offsetBits = log2i(policy.blockSize);
   uint32_t idBits = log2i(policy.blockNum / policy.associativity);
-  return (b.tag << (offsetBits + idBits)) | (b.id << offsetBits);
+  uint64_t id = blockId / policy.associativity;
+  return (this->tags[blockId] << (offsetBits + idBits)) | (id << offsetBits);
+}
+
+uint8_t *Cache::getBlockData(uint32_t blockId) {
+  if (this->tagOnly)
+    return nullptr;
+  return &this->data[(size_t)this->blockLine[blockId] * this->policy.blockSize];
+}
+
+void Cache::copyOut(uint32_t blockId, uint32_t offset, uint8_t *buf,
+                    uint32_t len) {
+  if (buf == nullptr)
+    return;
+  if (this->tagOnly)
+    memset(buf, 0, len);
+  else
+    memcpy(buf, this->getBlockData(blockId) + offset, len);
+}
+
+void Cache::copyIn(uint32_t blockId, uint32_t offset, const uint8_t *buf,
+                   uint32_t len) {
+  if (!this->tagOnly)
+    memcpy(this->getBlockData(blockId) + offset, buf, len);
 }
 
 #ifdef MEMORY_YYX
-uint32_t Cache::getGlobalUniqueBlockIDFromAddr(uint32_t addr) {
-  uint32_t offsetBits = log2i(policy.blockSize);
+uint64_t Cache::getGlobalUniqueBlockIDFromAddr(uint64_t addr) {
   uint32_t idBits = log2i(policy.blockNum / policy.associativity);  
   return  (this->getTag(addr) << idBits) | this->getId(addr);
 }  
 
-uint32_t Cache::getGlobalUniqueBlockIDFromBlock(Cache::Block &b) { 
-  uint32_t offsetBits = log2i(policy.blockSize);
+uint64_t Cache::getGlobalUniqueBlockIDFromBlock(uint32_t blockId) { 
   uint32_t idBits = log2i(policy.blockNum / policy.associativity);
-  return (b.tag << idBits) | b.id;  
+  return (this->tags[blockId] << idBits) | (blockId / policy.associativity);
 }  
 #endif
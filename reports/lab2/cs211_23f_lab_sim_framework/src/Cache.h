@@ -11,11 +11,17 @@
 #include <vector>
 
 #include "MemoryManager.h"
+#include "ReplacementPolicy.h"
 
 #define MEMORY_YYX
 #ifdef MEMORY_YYX
+#include <memory>
+#include <mutex>
 #include <unordered_map>
-#include <queue>
+#include <unordered_set>
+
+#include "Dram.h"
+#include "QuantumSync.h"
 
 enum InclusionType {
   NINE = 0,
@@ -25,16 +31,31 @@ enum InclusionType {
 };  
 enum ReplacementType {
   LRU = 0,
-  RRIP = 1,
+  RRIP = 1,   // SRRIP, static insertion at a long re-reference interval
   BELADY = 2,
+  BRRIP = 3,  // bimodal insertion, mostly at the distant interval
+  DRRIP = 4,  // SRRIP or BRRIP chosen by set dueling
+  // Implemented as ReplacementPolicy classes (see ReplacementPolicy.h)
+  PLRU = 5,    // tree pseudo LRU
+  BITLRU = 6,  // true LRU as a bit matrix
+  RANDOM = 7,
+  SHIP = 8,    // SHiP-PC, needs setCurrentPC
+  HAWKEYE = 9, // OPT learning, needs setCurrentPC
   ReplacementTypeNum
 };  
+// Order in which the victim buffer drops its entries
+enum VictimReplacementType {
+  VICTIM_FIFO = 0,
+  VICTIM_LRU = 1,
+  VictimReplacementTypeNum
+};
 
 
 #endif
 
 
 class MemoryManager;
+class MemoryTrace;
 
 class Cache {
 public:
@@ -48,26 +69,13 @@ public:
     uint32_t missLatency; // in cycles
   };
 
-  struct Block {
-    bool valid;
-    bool modified;
-    uint32_t tag;
-    uint32_t id;
-    uint32_t size;
-    uint32_t lastReference;
-    std::vector<uint8_t> data;
-  #ifdef MEMORY_YYX
-    int RRIPid;
-  #endif
-    Block() {}
-    Block(const Block &b)
-        : valid(b.valid), modified(b.modified), tag(b.tag), id(b.id),
-          size(b.size) {
-      data = b.data;
-    #ifdef MEMORY_YYX
-      RRIPid = -1;
-    #endif
-    }
+  // Per-block state flags, see Cache::flags
+  enum BlockFlag {
+    VALID = 1,
+    MODIFIED = 2,
+    // MESI, private caches of a multi-core run: the core holds the block E or
+    // M and may write it without asking the shared level
+    WRITABLE = 4,
   };
 
   struct Statistics {
@@ -79,23 +87,63 @@ public:
   };
 #ifdef MEMORY_YYX
   // give default values of new valuable to be compatible with original initializator
+  // tagOnly: keep metadata only (no block data, manager may be nullptr), used
+  // by the trace driven simulators, all levels of a hierarchy must agree
   Cache(MemoryManager *manager, Policy policy, Cache *lowerCache = nullptr,
         bool writeBack = true, bool writeAllocate = true, int inclusionType = NINE,
         Cache *upperCache = nullptr, int replacementType = LRU,
-        bool ifUsingVictimCache = false, int victimCacheCapacity = -1, int victimCacheLatency = -1);        
+        bool ifUsingVictimCache = false, int victimCacheCapacity = -1, int victimCacheLatency = -1,
+        bool tagOnly = false);        
 #else
   Cache(MemoryManager *manager, Policy policy, Cache *lowerCache = nullptr,
-        bool writeBack = true, bool writeAllocate = true);    
+        bool writeBack = true, bool writeAllocate = true, bool tagOnly = false);    
 #endif
 
 
-  bool inCache(uint32_t addr);
-  uint32_t getBlockId(uint32_t addr);
-  uint8_t getByte(uint32_t addr, uint32_t *cycles = nullptr);
-  void setByte(uint32_t addr, uint8_t val, uint32_t *cycles = nullptr);
+  bool inCache(uint64_t addr);
+  uint32_t getBlockId(uint64_t addr);
+  uint8_t getByte(uint64_t addr, uint32_t *cycles = nullptr);
+  void setByte(uint64_t addr, uint8_t val, uint32_t *cycles = nullptr);
+  // Sized accesses (e.g. 2/4/8 bytes or a whole block), each touched block is
+  // looked up and counted once, accesses crossing a block are split
+  void getBytes(uint64_t addr, uint8_t *buf, uint32_t len,
+                uint32_t *cycles = nullptr);
+  void setBytes(uint64_t addr, const uint8_t *buf, uint32_t len,
+                uint32_t *cycles = nullptr);
+  // Overwrite buf with the bytes of [addr, addr + len) cached in this or a
+  // lower level, the nearest copy being the newest. Not counted as an access
+  // and leaves the replacement state alone, false if nothing was cached
+  bool peek(uint64_t addr, uint8_t *buf, uint32_t len);
+  // Block transfers issued by the upper level cache, a whole block is moved
+  // in one access and charged one latency
+  void fillLine(uint64_t addr, uint8_t *buf, uint32_t len,
+                uint32_t *cycles = nullptr);
+  void writebackLine(uint64_t addr, const uint8_t *buf, uint32_t len,
+                     uint32_t *cycles = nullptr);
   #ifdef MEMORY_YYX
-  void exclusiveInvalidation(uint32_t addr);
+  void exclusiveInvalidation(uint64_t addr);
   void setUpperCache(Cache *upperCache);
+  void setVictimReplacementType(int victimReplacementType);
+  // PC of the instruction issuing the next accesses, passed down to the lower
+  // levels for PC based replacement policies
+  void setCurrentPC(uint64_t pc);
+  // Cycle of the next accesses and the DRAM model of the last level, which
+  // then replaces the fixed memory latency
+  void setCurrentCycle(uint64_t cycle);
+  void setDram(DramController *dram);
+  // MESI over several private hierarchies sharing this cache, which keeps a
+  // directory of the cores holding each of its blocks. privateCaches[i] is
+  // the lowest private level of core i, private levels must be NINE and have
+  // the same block size as this cache.
+  void enableDirectory(const std::vector<Cache *> &privateCaches);
+  // Host parallel runs: a core's accesses lock its private levels, and this
+  // cache too unless they hit in the top one. Owners are snooped at once,
+  // the other snoops only invalidate clean copies and are queued per core,
+  // each core's thread applies its own with drainSnoops() at quantum
+  // boundaries
+  void enableParallelSnoops();
+  void drainSnoops(int core);
+  void printCoherenceStatistics();
   int victimCacheCapacity;
   #endif  
 
@@ -105,58 +153,196 @@ public:
   Statistics statistics;
 
 #ifdef MEMORY_YYX
+  // Victim buffer lookups, i.e. L1 misses probed in the buffer
+  Statistics victimStatistics;
+  // INCLUSIVE: evictions of valid blocks that sent a back invalidation to the
+  // upper level, and those skipped because nothing was held above
+  uint32_t numBackInvalidation;
+  uint32_t numBackInvalidationFiltered;
+  // Directory of a shared cache (see enableDirectory)
+  struct CoherenceStatistics {
+    uint32_t numCoherenceMiss; // misses to blocks another core invalidated
+    uint32_t numInvalidation;  // private copies invalidated by other cores
+    uint32_t numUpgrade;       // shared copies written, permission requests
+    uint32_t numDowngrade;     // E or M copies turned S by other cores' reads
+    uint32_t numFlush;         // dirty private copies written back by snoops
+    uint32_t numEvictInvalidation; // private copies dropped by evictions here
+    uint64_t totalCycles;          // latency of snoops and upgrades
+  } coherenceStatistics;
   // BELADY
-  std::unordered_map<uint32_t, std::vector<int>> globalBlockID2Times;
-  std::unordered_map<uint32_t, int> globalBlockIDCurrentOrder; 
+  // nextUse[i]: index of the next trace access to the block of access i,
+  // MAXNEXTAPPEARTIME if none; shared by levels with the same block size
+  std::shared_ptr<const std::vector<uint32_t>> nextUse;
+  uint32_t beladyTime; // index of the current trace access
   const uint32_t MAXNEXTAPPEARTIME = UINT32_MAX;
-  void preInputAddrGlobalBlockIDForBelady(const char * traceFilePath);
-  void updateGlobalBlockIDCurrentTime(uint32_t addr);
-  uint32_t getNextSameGlobalBlockIDTimeFromGlobalBlockID(uint32_t addr);
+  void preInputAddrGlobalBlockIDForBelady(const MemoryTrace &trace);
+  // Advance to the next trace access, call before each access
+  void updateGlobalBlockIDCurrentTime(uint64_t addr);
 #endif
 private:
   uint32_t referenceCounter;
   bool writeBack;     // default true
   bool writeAllocate; // default true
+  bool tagOnly;       // default false
   #ifdef MEMORY_YYX
   int inclusionType;
   Cache* upperCache;
   int replacementType;
+  // Policy object of the types outside Cache, nullptr otherwise
+  std::unique_ptr<ReplacementPolicy> replacementPolicy;
+  uint64_t currentPC;
+  DramController *dram;
+  uint64_t currentCycle;
   //victimCache
   bool ifUsingVictimCache;
-  std::queue<Block> victimCache;
   uint32_t victimCacheLatency; 
+  int victimReplacementType;
   // default: if using victim to search, then add to global cycle, if just write to victim cache, presume it written concurrently with L2, so it spare no time 
   #endif
   MemoryManager *memory;
   Cache *lowerCache;
   Policy policy;
-  std::vector<Block> blocks;
+  // Block state is kept in dense arrays indexed by block id, the blocks of a
+  // set are contiguous (set * associativity + way)
+  std::vector<uint64_t> tags;
+  std::vector<uint8_t> flags;
+  std::vector<uint32_t> lastReference;
+  #ifdef MEMORY_YYX
+  // RRIP: RRPV_BITS wide re-reference prediction value per block, 0 is
+  // near-immediate and RRPV_MAX distant (evicted first)
+  static const uint8_t RRPV_BITS = 2;
+  static const uint8_t RRPV_MAX = (1 << RRPV_BITS) - 1;
+  // BRRIP inserts at RRPV_MAX - 1 once every BRRIP_EPSILON fills
+  static const uint32_t BRRIP_EPSILON = 32;
+  // DRRIP: DUEL_LEADER_SETS sets always use SRRIP and as many BRRIP, their
+  // misses steer the PSEL_BITS wide counter followed by the other sets
+  static const uint32_t DUEL_LEADER_SETS = 32;
+  static const uint32_t PSEL_BITS = 10;
+  static const uint32_t PSEL_MAX = (1 << PSEL_BITS) - 1;
+  enum DuelingSetType { FOLLOWER_SET, SRRIP_LEADER_SET, BRRIP_LEADER_SET };
+  std::vector<uint8_t> RRIPid;
+  // INCLUSIVE: number of upper level blocks held above each block, kept up
+  // to date by the upper level (updatePresence), a snoop filter for back
+  // invalidations
+  std::vector<uint32_t> presence;
+  uint32_t brripCounter;
+  uint32_t psel;
+  // BELADY: index of a trace access to the block no later than its latest
+  // access, may be stale when the upper level served later accesses
+  std::vector<uint32_t> lastAccessIndex;
+  // Access index of the block being written back by the upper level, set
+  // around writebackLine, MAXNEXTAPPEARTIME for the current access's block
+  uint32_t accessHint;
+  // Coherence: core owning a private cache, -1 for a shared or single-core
+  // cache. The request context is set by the upper level around fillLine
+  // like accessHint, grantExclusive answers whether the block came E.
+  int coreId;
+  int requestCore;
+  bool requestExclusive;
+  bool grantExclusive;
+  // Directory, per block bit i of sharers set if core i may hold it, owned
+  // if the only sharer holds it E or M. invalidatedBlocks[i] holds the
+  // global block ids core i lost to other cores' writes.
+  std::vector<Cache *> privateCaches;
+  std::vector<uint32_t> sharers;
+  std::vector<uint8_t> owned;
+  std::vector<std::unordered_set<uint64_t>> invalidatedBlocks;
+  bool parallel;
+  std::mutex sharedLock;
+  std::vector<std::unique_ptr<SnoopQueue>> snoopQueues;
+  std::vector<uint8_t> snoopBuffer; // data flushed by a queued snoop
+  // Parallel runs: a lock per core over its private levels, and the core
+  // holding sharedLock. Private levels point to the shared one and their
+  // core's lock.
+  std::vector<std::unique_ptr<std::mutex>> coreLocks;
+  int lockingCore;
+  Cache *sharedLevel;
+  std::mutex *coreLock;
+  enum SnoopResult { SNOOP_HIT = 1, SNOOP_DIRTY = 2 };
+  #endif
+  // Block data, blockSize bytes per line in one arena, blockLine maps a block
+  // to its line so a victim swap only exchanges line numbers
+  std::vector<uint8_t> data;
+  std::vector<uint32_t> blockLine;
+  // Staging area for the block being filled from the lower level
+  std::vector<uint8_t> fillBuffer;
+  #ifdef MEMORY_YYX
+  // Victim buffer, fully associative and clean (dirty blocks are written back
+  // when L1 evicts them). victimIndex maps a global unique block id to its
+  // slot, each slot owns an arena line past the L1 blocks. Occupied slots are
+  // linked from victimHead (next to drop) to victimTail, free ones are kept in
+  // victimFree.
+  std::unordered_map<uint64_t, uint32_t> victimIndex;
+  std::vector<uint64_t> victimBlockIds;
+  std::vector<uint32_t> victimLine;
+  std::vector<uint32_t> victimPrev;
+  std::vector<uint32_t> victimNext;
+  std::vector<uint32_t> victimFree;
+  uint32_t victimHead;
+  uint32_t victimTail;
+  #endif
 
   void initCache();
-  void loadBlockFromLowerLevel(uint32_t addr, uint32_t *cycles = nullptr);
+  void readFromBlock(uint64_t addr, uint8_t *buf, uint32_t len,
+                     uint32_t *cycles);
+  void writeToBlock(uint64_t addr, const uint8_t *buf, uint32_t len,
+                    uint32_t *cycles);
+  void loadBlockFromLowerLevel(uint64_t addr, uint32_t *cycles = nullptr,
+                               bool exclusive = false);
   uint32_t getReplacementBlockId(uint32_t begin, uint32_t end);
-  void writeBlockToLowerLevel(Block &b);
+  void writeBlockToLowerLevel(uint32_t blockId);
   #ifdef MEMORY_YYX
   void updateLowerLevelAccordingToPolicy(int blockId);
-  void writeBlockToMemory(Cache::Block &b);
-  void backInvalidation(Cache *cache, uint32_t addr);
-  void writeBlockToLowerLevelWithoutMemory(Block &b);
+  void writeBlockToMemory(uint32_t blockId);
+  void backInvalidation(uint64_t addr, uint32_t len);
+  void updatePresence(uint64_t addr, uint32_t len, bool present);
+  void writeBlockToLowerLevelWithoutMemory(uint32_t blockId);
+  void updateReplacementPolicy(uint32_t blockId, bool hit);
+  // RRIP
+  bool isRRIP();
+  int getDuelingSetType(uint32_t setId);
+  uint8_t getRRIPInsertion(uint32_t setId);
   // Victim Cache
-  // bool loadBlockFromVictimCache(uint32_t addr, uint32_t *cycles = nullptr);
+  bool loadBlockFromVictimCache(uint64_t addr, bool isWrite);
+  void insertVictim(uint32_t blockId);
+  void unlinkVictim(uint32_t slot);
+  void appendVictim(uint32_t slot);
+  bool removeVictim(uint64_t addr);
+  // Coherence
+  uint32_t serveCoherentRequest(uint32_t blockId, uint64_t addr);
+  uint32_t acquireWritable(uint64_t addr);
+  uint32_t coherentUpgrade(int core, uint64_t addr);
+  uint32_t snoopSharers(uint32_t blockId, uint32_t mask, bool invalidate,
+                        bool byEviction);
+  int snoop(uint64_t addr, bool invalidate, uint8_t *data);
+  void recordSnoop(int core, uint64_t addr, const SnoopRequest &request,
+                   int result);
+  void applySnoops(int core);
+  void lockAccess(uint64_t addr, bool write,
+                  std::unique_lock<std::mutex> &shared,
+                  std::unique_lock<std::mutex> &core);
   #endif  
 
   // Utility Functions
   bool isPolicyValid();
   bool isPowerOfTwo(uint32_t n);
   uint32_t log2i(uint32_t val);
-  uint32_t getTag(uint32_t addr);
-  uint32_t getId(uint32_t addr);
-  uint32_t getOffset(uint32_t addr);
-  uint32_t getAddr(Block &b); // actually from b get the getGlobalUniqueBlockIDFromAddr with 0 offest
+  uint64_t getTag(uint64_t addr);
+  uint32_t getId(uint64_t addr);
+  uint32_t getOffset(uint64_t addr);
+  uint64_t getAddr(uint32_t blockId); // address of the block with 0 offset
+  uint8_t *getBlockData(uint32_t blockId);
+  void copyOut(uint32_t blockId, uint32_t offset, uint8_t *buf, uint32_t len);
+  void copyIn(uint32_t blockId, uint32_t offset, const uint8_t *buf,
+              uint32_t len);
 #ifdef MEMORY_YYX
   // BELADY
-  uint32_t getGlobalUniqueBlockIDFromAddr(uint32_t addr);
-  uint32_t getGlobalUniqueBlockIDFromBlock(Block &b); 
+  uint64_t getGlobalUniqueBlockIDFromAddr(uint64_t addr);
+  uint64_t getGlobalUniqueBlockIDFromBlock(uint32_t blockId);
+  uint32_t getNextUse(uint32_t blockId);
+  void recordAccess(uint32_t blockId);
+  // Trace access index passed down with a write back of the block
+  uint32_t getAccessHint(uint32_t blockId);
 #endif  
 };
 
@@ -0,0 +1,188 @@
+/*
+ * DRAM timing model behind the last level cache
+ */
+
+#include "Dram.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+const uint32_t DramController::NO_ROW;
+
+static bool isPowerOfTwo(uint32_t n) { return n > 0 && (n & (n - 1)) == 0; }
+
+static uint32_t log2i(uint32_t val) {
+  uint32_t ret = 0;
+  while (val > 1) {
+    val >>= 1;
+    ret++;
+  }
+  return ret;
+}
+
+DramController::Policy DramController::defaultPolicy(bool openPage) {
+  Policy policy;
+  policy.channels = 2;
+  policy.ranks = 1;
+  policy.banks = 16;
+  policy.rowSize = 8 * 1024;
+  policy.blockSize = 64;
+  policy.openPage = openPage;
+  // DDR4-2400 CL17 seen from a 3GHz core
+  policy.tRCD = 42;
+  policy.tCAS = 42;
+  policy.tRP = 42;
+  policy.tBURST = 10;
+  policy.queueSize = 32;
+  return policy;
+}
+
+DramController::DramController(Policy policy) {
+  if (!isPowerOfTwo(policy.channels) || !isPowerOfTwo(policy.ranks) ||
+      !isPowerOfTwo(policy.banks) || !isPowerOfTwo(policy.rowSize) ||
+      !isPowerOfTwo(policy.blockSize) || policy.rowSize < policy.blockSize) {
+    fprintf(stderr, "Invalid DRAM geometry\n");
+    exit(-1);
+  }
+  this->policy = policy;
+  this->blockBits = log2i(policy.blockSize);
+  this->channelBits = log2i(policy.channels);
+  this->columnBits = log2i(policy.rowSize / policy.blockSize);
+  this->bankBits = log2i(policy.ranks * policy.banks);
+  this->channels = std::vector<Channel>(policy.channels);
+  for (Channel &channel : this->channels) {
+    Bank bank;
+    bank.openRow = NO_ROW;
+    bank.readyCycle = 0;
+    channel.banks = std::vector<Bank>(policy.ranks * policy.banks, bank);
+    channel.busReady = 0;
+    channel.queue.reserve(policy.queueSize + 1);
+  }
+  memset(&this->statistics, 0, sizeof(this->statistics));
+  this->statistics.firstCycle = UINT64_MAX;
+}
+
+// block offset | channel | column | bank (and rank) | row
+DramController::Request DramController::decode(uint64_t addr, bool isWrite,
+                                               uint64_t now,
+                                               uint32_t *channel) {
+  uint64_t block = addr >> this->blockBits;
+  *channel = block & (this->policy.channels - 1);
+  uint64_t rest = block >> (this->channelBits + this->columnBits);
+  Request request;
+  request.addr = addr;
+  request.bank = rest & ((1u << this->bankBits) - 1);
+  request.row = rest >> this->bankBits;
+  request.isWrite = isWrite;
+  request.arrival = now;
+  return request;
+}
+
+uint32_t DramController::read(uint64_t addr, uint64_t now) {
+  uint32_t c;
+  Request request = this->decode(addr, false, now, &c);
+  Channel &channel = this->channels[c];
+  this->statistics.numRead++;
+  channel.queue.push_back(request);
+  // Serve the queue until the read is out, row hit writes may go first
+  while (true) {
+    uint32_t next = this->pickFRFCFS(channel, true);
+    Request served = channel.queue[next];
+    channel.queue.erase(channel.queue.begin() + next);
+    uint64_t finish = this->serve(channel, served);
+    if (!served.isWrite) {
+      this->statistics.totalReadLatency += finish - now;
+      return finish - now;
+    }
+  }
+}
+
+void DramController::write(uint64_t addr, uint64_t now) {
+  uint32_t c;
+  Request request = this->decode(addr, true, now, &c);
+  Channel &channel = this->channels[c];
+  this->statistics.numWrite++;
+  channel.queue.push_back(request);
+  if (channel.queue.size() > this->policy.queueSize) {
+    uint32_t next = this->pickFRFCFS(channel, false);
+    Request served = channel.queue[next];
+    channel.queue.erase(channel.queue.begin() + next);
+    this->serve(channel, served);
+  }
+}
+
+// Oldest request to an open row, else the oldest read if preferred (a read
+// is queued then), else the oldest request
+uint32_t DramController::pickFRFCFS(const Channel &channel, bool preferRead) {
+  if (this->policy.openPage) {
+    for (uint32_t i = 0; i < channel.queue.size(); ++i) {
+      const Request &request = channel.queue[i];
+      if (channel.banks[request.bank].openRow == request.row)
+        return i;
+    }
+  }
+  if (preferRead) {
+    for (uint32_t i = 0; i < channel.queue.size(); ++i) {
+      if (!channel.queue[i].isWrite)
+        return i;
+    }
+  }
+  return 0;
+}
+
+// Returns the cycle the block has been transferred
+uint64_t DramController::serve(Channel &channel, const Request &request) {
+  Bank &bank = channel.banks[request.bank];
+  uint64_t start = std::max(request.arrival, bank.readyCycle);
+  uint32_t latency = this->policy.tCAS;
+  if (bank.openRow == request.row) {
+    this->statistics.numRowHit++;
+  } else if (bank.openRow == NO_ROW) {
+    this->statistics.numRowMiss++;
+    latency += this->policy.tRCD;
+  } else {
+    this->statistics.numRowConflict++;
+    latency += this->policy.tRP + this->policy.tRCD;
+  }
+  uint64_t transfer = std::max(start + latency, channel.busReady);
+  uint64_t finish = transfer + this->policy.tBURST;
+  channel.busReady = finish;
+  if (this->policy.openPage) {
+    bank.openRow = request.row;
+    bank.readyCycle = transfer;
+  } else {
+    bank.openRow = NO_ROW;
+    bank.readyCycle = finish + this->policy.tRP;
+  }
+  this->record(request.arrival, finish);
+  return finish;
+}
+
+void DramController::record(uint64_t arrival, uint64_t finish) {
+  this->statistics.firstCycle = std::min(this->statistics.firstCycle, arrival);
+  this->statistics.lastCycle = std::max(this->statistics.lastCycle, finish);
+}
+
+void DramController::printStatistics() {
+  const Statistics &s = this->statistics;
+  uint64_t served = s.numRowHit + s.numRowMiss + s.numRowConflict;
+  uint64_t span = served ? s.lastCycle - s.firstCycle : 0;
+  printf("------------- DRAM -------------\n");
+  printf("Geometry: %d channels, %d ranks, %d banks, %d byte rows (%s page)\n",
+         this->policy.channels, this->policy.ranks, this->policy.banks,
+         this->policy.rowSize, this->policy.openPage ? "open" : "closed");
+  printf("Num Read: %llu\n", (unsigned long long)s.numRead);
+  printf("Num Write: %llu\n", (unsigned long long)s.numWrite);
+  printf("Row Hits: %llu, Misses: %llu, Conflicts: %llu\n",
+         (unsigned long long)s.numRowHit, (unsigned long long)s.numRowMiss,
+         (unsigned long long)s.numRowConflict);
+  printf("Row Buffer Hit Rate: %.4f\n",
+         served ? (double)s.numRowHit / served : 0.0);
+  printf("Avg Read Latency: %.2f cycles\n",
+         s.numRead ? (double)s.totalReadLatency / s.numRead : 0.0);
+  printf("Bandwidth: %.4f bytes/cycle over %llu cycles\n",
+         span ? (double)served * this->policy.blockSize / span : 0.0,
+         (unsigned long long)span);
+}
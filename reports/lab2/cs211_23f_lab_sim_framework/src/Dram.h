@@ -0,0 +1,96 @@
+/*
+ * DRAM timing model behind the last level cache
+ *
+ * Blocks are interleaved over channels first, then fill a row of a bank
+ * before moving to the next bank and rank. Every bank has a row buffer, an
+ * open page policy keeps the row open after an access, a closed page policy
+ * precharges right away. An access costs tCAS on a row hit, tRCD + tCAS on a
+ * closed bank and tRP + tRCD + tCAS on a row conflict, then tBURST on the
+ * channel's data bus. All timings are in CPU cycles.
+ *
+ * Reads are served as they come since the cache blocks on them, write backs
+ * are posted to the channel's queue. Whenever a read arrives or the queue is
+ * full, the queue is scheduled FR-FCFS: row hits first, then the oldest read,
+ * or the oldest write when draining a full queue.
+ */
+
+#ifndef DRAM_H
+#define DRAM_H
+
+#include <cstdint>
+#include <vector>
+
+class DramController {
+public:
+  struct Policy {
+    uint32_t channels;  // all must be powers of 2
+    uint32_t ranks;     // per channel
+    uint32_t banks;     // per rank
+    uint32_t rowSize;   // in bytes
+    uint32_t blockSize; // bytes per access, the cache block size
+    bool openPage;
+    uint32_t tRCD; // activate to column command
+    uint32_t tCAS; // column command to data
+    uint32_t tRP;  // precharge
+    uint32_t tBURST; // data bus time of a block
+    uint32_t queueSize; // posted writes per channel before they are forced
+  };
+
+  struct Statistics {
+    uint64_t numRead;
+    uint64_t numWrite;
+    uint64_t numRowHit;
+    uint64_t numRowMiss;     // bank precharged
+    uint64_t numRowConflict; // another row open
+    uint64_t totalReadLatency;
+    uint64_t firstCycle; // first arrival
+    uint64_t lastCycle;  // last data transfer end
+  };
+
+  // Sensible DDR4 like defaults for a 64 byte block
+  static Policy defaultPolicy(bool openPage);
+
+  explicit DramController(Policy policy);
+
+  // Latency of a read of the block at addr issued at cycle now
+  uint32_t read(uint64_t addr, uint64_t now);
+  // Posted, the writer does not wait
+  void write(uint64_t addr, uint64_t now);
+
+  void printStatistics();
+
+  Statistics statistics;
+
+private:
+  static const uint32_t NO_ROW = UINT32_MAX;
+
+  struct Request {
+    uint64_t addr;
+    uint32_t bank; // index over the channel's ranks and banks
+    uint32_t row;
+    bool isWrite;
+    uint64_t arrival;
+  };
+
+  struct Bank {
+    uint32_t openRow;
+    uint64_t readyCycle; // may take the next command
+  };
+
+  struct Channel {
+    std::vector<Bank> banks;
+    std::vector<Request> queue; // arrival order
+    uint64_t busReady;
+  };
+
+  Policy policy;
+  uint32_t blockBits, channelBits, columnBits, bankBits;
+  std::vector<Channel> channels;
+
+  Request decode(uint64_t addr, bool isWrite, uint64_t now, uint32_t *channel);
+  uint32_t pickFRFCFS(const Channel &channel, bool preferRead);
+  uint64_t serve(Channel &channel, const Request &request);
+  void record(uint64_t arrival, uint64_t finish);
+};
+
+#endif
@@ -2,31 +2,48 @@
  * Created by He, Hao at 2019-3-11
  */
 
+#include <algorithm>
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <elfio/elfio.hpp>
 
 #include "BranchPredictor.h"
 #include "Cache.h"
 #include "Debug.h"
+#include "Dram.h"
 #include "MemoryManager.h"
+#include "QuantumSync.h"
 #include "Simulator.h"
+#include "Tlb.h"
 
 bool parseParameters(int argc, char **argv);
 void printUsage();
 void printElfInfo(ELFIO::elfio *reader);
 void loadElfToMemory(ELFIO::elfio *reader, MemoryManager *memory);
+#ifdef MEMORY_YYX
+void simulateMultiCore(uint64_t entry, Cache::Policy l1Policy,
+                       Cache::Policy l2Policy, int victimCacheCapacity,
+                       int victimCacheLatency);
+#endif
 
 char *elfFile = nullptr;
 bool verbose = 0;
 bool isSingleStep = 0;
 bool dumpHistory = 0;
-uint32_t stackBaseAddr = 0x80000000;
-uint32_t stackSize = 0x400000;
+bool mapText = false;
+uint32_t checkpointInterval = 0;
+uint64_t stackBaseAddr = 0x80000000;
+uint64_t stackSize = 0x400000;
 MemoryManager memory;
 Cache *l1Cache, *l2Cache, *l3Cache;
 BranchPredictor::Strategy strategy = BranchPredictor::Strategy::NT;
@@ -38,6 +55,13 @@ int inclusionType = NINE;
 int L1ReplacementType = LRU;
 int L2ReplacementType = LRU;
 int ifUseVictimCache = false; // 1 :using Victim cache, 2: not use, but for comparison that have same L1 associatity
+int numCores = 1;
+uint32_t quantum = 0; // cycles between synchronizations, 0: one host thread
+int dramPagePolicy = -1; // -1: fixed memory latency, 0: closed page, 1: open
+DramController *dram = nullptr;
+bool useTlb = false;
+Mmu::Policy tlbPolicy = Mmu::defaultPolicy();
+int flatSpace = 0; // 0: a host page per guest page, 1: flat, 2: flat on THP
 #endif
 
 int main(int argc, char **argv) {
@@ -46,6 +70,12 @@ int main(int argc, char **argv) {
     exit(-1);
   }
 
+#ifdef MEMORY_YYX
+  if (flatSpace && !memory.useFlatSpace(flatSpace == 2)) {
+    fprintf(stderr, "Fail to reserve a flat guest space, using pages\n");
+  }
+#endif
+
   // Init cache
   Cache::Policy l1Policy, l2Policy, l3Policy;
 #ifdef MEMORY_YYX
@@ -74,6 +104,8 @@ int main(int argc, char **argv) {
   l2Cache = new Cache(&memory, l2Policy, nullptr, true, true, inclusionType, nullptr, L2ReplacementType);
   l1Cache = new Cache(&memory, l1Policy, l2Cache, true, true, inclusionType, nullptr, L1ReplacementType, ifUseVictimCache, victimCacheCapacity,victimCacheLatency);
   l2Cache->setUpperCache(l1Cache);
+  if (dramPagePolicy >= 0)
+    dram = new DramController(DramController::defaultPolicy(dramPagePolicy));
 #else
   l1Policy.cacheSize = 32 * 1024;
   l1Policy.blockSize = 64;
@@ -121,18 +153,38 @@ int main(int argc, char **argv) {
     memory.printInfo();
   }
 
+#ifdef MEMORY_YYX
+  if (numCores > 1) {
+    simulateMultiCore(reader.get_entry(), l1Policy, l2Policy,
+                      victimCacheCapacity, victimCacheLatency);
+    delete l1Cache;
+    delete l2Cache;
+    delete dram;
+    return 0;
+  }
+#endif
+
   simulator.isSingleStep = isSingleStep;
   simulator.verbose = verbose;
   simulator.shouldDumpHistory = dumpHistory;
+  simulator.checkpointInterval = checkpointInterval;
   simulator.branchPredictor->strategy = strategy;
   simulator.pc = reader.get_entry();
   simulator.initStack(stackBaseAddr, stackSize);
+#ifdef MEMORY_YYX
+  // Timed from the first cycle, the stack set up above is not
+  l2Cache->setDram(dram);
+  if (useTlb)
+    simulator.mmu = new Mmu(&memory, tlbPolicy);
+#endif
   simulator.simulate();
-
-  if (dumpHistory) {
-    printf("Dumping history to dump.txt...\n");
-    simulator.dumpHistory();
+#ifdef MEMORY_YYX
+  if (dram) {
+    dram->printStatistics();
+    delete dram;
   }
+  delete simulator.mmu;
+#endif
 
   delete l1Cache;
   delete l2Cache;
@@ -173,6 +225,22 @@ bool parseParameters(int argc, char **argv) {
           return false;
         }
         break;
+      case 'X':
+        // map text from the ELF file
+        mapText = true;
+        break;
+      case 'c':
+        // memory checkpoint interval
+        if (i + 1 < argc) {
+          checkpointInterval = atoi(argv[i + 1]);
+          i++;
+          if (checkpointInterval == 0) {
+            return false;
+          }
+        } else {
+          return false;
+        }
+        break;
 #ifdef MEMORY_YYX
       case 'i':
         // inclusion type
@@ -201,18 +269,12 @@ bool parseParameters(int argc, char **argv) {
           std::string str = argv[i + 1];
           i++;
           std::cout << str << std::endl;
-          if (str == "LRU") {
-            L1ReplacementType = LRU;
-            printf("L1ReplacementType: LRU\n");
-          } else if (str == "RRIP") {
-            L1ReplacementType = RRIP;
-            printf("L1ReplacementType: RRIP\n");
-          } else if (str == "BELADY") {
-            L1ReplacementType = BELADY;
-            printf("L1ReplacementType: BELADY\n");
-          } else {
+          L1ReplacementType = getReplacementTypeFromName(str);
+          if (L1ReplacementType < 0) {
             return false;
           }
+          printf("L1ReplacementType: %s\n",
+                 getReplacementTypeName(L1ReplacementType));
         } else {
           return false;
         }
@@ -222,18 +284,12 @@ bool parseParameters(int argc, char **argv) {
         if (i + 1 < argc) {
           std::string str = argv[i + 1];
           i++;
-          if (str == "LRU") {
-            L2ReplacementType = LRU;
-            printf("L2ReplacementType: LRU\n");
-          } else if (str == "RRIP") {
-            L2ReplacementType = RRIP;
-            printf("L2ReplacementType: RRIP\n");
-          } else if (str == "BELADY") {
-            L2ReplacementType = BELADY;
-            printf("L2ReplacementType: BELADY\n");
-          } else {
+          L2ReplacementType = getReplacementTypeFromName(str);
+          if (L2ReplacementType < 0) {
             return false;
           }
+          printf("L2ReplacementType: %s\n",
+                 getReplacementTypeName(L2ReplacementType));
         } else {
           return false;
         }
@@ -256,6 +312,73 @@ bool parseParameters(int argc, char **argv) {
           return false;
         }
         break;
+      case 'n':
+        // number of cores
+        if (i + 1 < argc) {
+          numCores = atoi(argv[i + 1]);
+          i++;
+          if (numCores < 1 || numCores > 32) {
+            return false;
+          }
+        } else {
+          return false;
+        }
+        break;
+      case 'D':
+        // DRAM model and its row buffer policy
+        if (i + 1 < argc) {
+          std::string str = argv[i + 1];
+          i++;
+          if (str == "OPEN") {
+            dramPagePolicy = 1;
+          } else if (str == "CLOSED") {
+            dramPagePolicy = 0;
+          } else {
+            return false;
+          }
+        } else {
+          return false;
+        }
+        break;
+      case 'T':
+        // TLB entries
+        if (i + 1 < argc) {
+          if (sscanf(argv[i + 1], "%u,%u,%u", &tlbPolicy.itlbEntries,
+                     &tlbPolicy.dtlbEntries, &tlbPolicy.l2tlbEntries) != 3) {
+            return false;
+          }
+          i++;
+          useTlb = true;
+        } else {
+          return false;
+        }
+        break;
+      case 'P':
+        // 4MB pages
+        tlbPolicy.superpages = true;
+        useTlb = true;
+        break;
+      case 'F':
+        // flat guest space
+        if (flatSpace == 0)
+          flatSpace = 1;
+        break;
+      case 'H':
+        // flat guest space on transparent huge pages
+        flatSpace = 2;
+        break;
+      case 'q':
+        // quantum of a host parallel multi-core run
+        if (i + 1 < argc) {
+          quantum = atoi(argv[i + 1]);
+          i++;
+          if (quantum == 0) {
+            return false;
+          }
+        } else {
+          return false;
+        }
+        break;
 #endif        
       default:
         return false;
@@ -277,9 +400,27 @@ bool parseParameters(int argc, char **argv) {
 void printUsage() {
   printf("Usage: Simulator riscv-elf-file [-v] [-s] [-d] [-b param]\n");
   printf("Parameters: \n\t[-v] verbose output \n\t[-s] single step\n");
-  printf("\t[-d] dump memory and register trace to dump.txt\n");
+  printf("\t[-d] dump register trace to dump.txt and memory to dump.mem\n");
   printf("\t[-b param] branch perdiction strategy, accepted param AT, NT, "
          "BTFNT, BPB\n");
+  printf("\t[-X] map read-only text segments from the ELF file instead of "
+         "copying them\n");
+  printf("\t[-c cycles] write a memory checkpoint every given number of "
+         "cycles, checkpoint.0.mem in full and later ones only the pages "
+         "written since, single core only\n");
+#ifdef MEMORY_YYX
+  printf("\t[-n cores] run the program on 1 to 32 cores sharing a MESI L3, "
+         "tp holds the hart id\n");
+  printf("\t[-q cycles] simulate each core on its own host thread, "
+         "synchronizing every given number of cycles\n");
+  printf("\t[-D page] DRAM timing model instead of a fixed memory latency, "
+         "accepted param OPEN, CLOSED\n");
+  printf("\t[-T itlb,dtlb,l2tlb] model TLBs with the given entries and page "
+         "walks through the caches\n");
+  printf("\t[-P] map 4MB superpages, implies TLBs\n");
+  printf("\t[-F] back guest memory with one flat 4GB host reservation\n");
+  printf("\t[-H] as -F, on transparent huge pages\n");
+#endif
 }
 
 void printElfInfo(ELFIO::elfio *reader) {
@@ -331,34 +472,151 @@ void printElfInfo(ELFIO::elfio *reader) {
 }
 
 void loadElfToMemory(ELFIO::elfio *reader, MemoryManager *memory) {
+  int fd = mapText ? open(elfFile, O_RDONLY) : -1;
   ELFIO::Elf_Half seg_num = reader->segments.size();
   for (int i = 0; i < seg_num; ++i) {
     const ELFIO::segment *pseg = reader->segments[i];
 
-    uint64_t fullmemsz = pseg->get_memory_size();
-    uint64_t fulladdr = pseg->get_virtual_address();
-    // Our 32bit simulator cannot handle this
-    if (fulladdr + fullmemsz > 0xFFFFFFFF) {
-      dbgprintf(
-          "ELF address space larger than 32bit! Seg %d has max addr of 0x%lx\n",
-          i, fulladdr + fullmemsz);
-      exit(-1);
-    }
+    uint64_t filesz = pseg->get_file_size();
+    uint64_t memsz = pseg->get_memory_size();
+    uint64_t addr = pseg->get_virtual_address();
 
-    uint32_t filesz = pseg->get_file_size();
-    uint32_t memsz = pseg->get_memory_size();
-    uint32_t addr = (uint32_t)pseg->get_virtual_address();
+    // Read-only text straight from the file, the page cache backs it
+    if (mapText && fd >= 0 && (pseg->get_flags() & PF_X) &&
+        !(pseg->get_flags() & PF_W) && filesz == memsz &&
+        memory->mapFile(addr, fd, pseg->get_offset(), filesz)) {
+      continue;
+    }
 
-    for (uint32_t p = addr; p < addr + memsz; ++p) {
+    // A page at a time, new pages come zeroed so the bss only needs clearing
+    // where it shares a page that already existed. The bss pages past the
+    // file bytes are only added on their first access
+    uint64_t zeroBegin = (addr + filesz + 0xFFF) & ~(uint64_t)0xFFF;
+    uint64_t zeroEnd = std::max(zeroBegin, (addr + memsz) & ~(uint64_t)0xFFF);
+    for (uint64_t p = addr & ~(uint64_t)0xFFF; p < addr + memsz; p += 4096) {
       if (!memory->isPageExist(p)) {
-        memory->addPage(p);
+        if (p < zeroBegin || p >= zeroEnd)
+          memory->addPage(p);
+        continue;
+      }
+      uint64_t begin = std::max(p, addr + filesz);
+      uint64_t end = std::min(p + 4096, addr + memsz);
+      if (begin < end) {
+        uint8_t zeros[4096];
+        memset(zeros, 0, sizeof(zeros));
+        memory->setBytesNoCache(begin, zeros, end - begin);
       }
+    }
+    if (zeroBegin < zeroEnd)
+      memory->addZeroRegion(zeroBegin, zeroEnd);
+    memory->setBytesNoCache(addr, (const uint8_t *)pseg->get_data(), filesz);
+  }
+  if (fd >= 0)
+    close(fd);
+}
 
-      if (p < addr + filesz) {
-        memory->setByteNoCache(p, pseg->get_data()[p - addr]);
-      } else {
-        memory->setByteNoCache(p, 0);
+#ifdef MEMORY_YYX
+// Every core runs the program from the entry with its own stack, pipeline and
+// private NINE L1/L2, an 8MB L3 is shared and keeps the MESI directory. The
+// cores advance one cycle each in turn until all of them called exit(), or
+// with a quantum each on its own host thread, a quantum at a time. An owned
+// block is then snooped at once, invalidations of clean shared copies are
+// applied at quantum boundaries, so within a quantum a core may still read
+// the old value of a block another core has since written.
+void simulateMultiCore(uint64_t entry, Cache::Policy l1Policy,
+                       Cache::Policy l2Policy, int victimCacheCapacity,
+                       int victimCacheLatency) {
+  Cache::Policy l3Policy;
+  l3Policy.cacheSize = 8 * 1024 * 1024;
+  l3Policy.blockSize = 64;
+  l3Policy.blockNum = l3Policy.cacheSize / l3Policy.blockSize;
+  l3Policy.associativity = 8;
+  l3Policy.hitLatency = 20;
+  l3Policy.missLatency = 100;
+  Cache *l3 = new Cache(&memory, l3Policy, nullptr, true, true, NINE, nullptr,
+                        L2ReplacementType);
+
+  std::vector<MemoryManager *> views;
+  std::vector<Cache *> l1s, l2s;
+  for (int i = 0; i < numCores; ++i) {
+    // Same pages, the core's own cache hierarchy
+    MemoryManager *view = new MemoryManager(&memory);
+    Cache *l2 = new Cache(view, l2Policy, l3, true, true, NINE, nullptr,
+                          L2ReplacementType);
+    Cache *l1 = new Cache(view, l1Policy, l2, true, true, NINE, nullptr,
+                          L1ReplacementType, ifUseVictimCache,
+                          victimCacheCapacity, victimCacheLatency);
+    l2->setUpperCache(l1);
+    view->setCache(l1);
+    views.push_back(view);
+    l1s.push_back(l1);
+    l2s.push_back(l2);
+  }
+  l3->enableDirectory(l2s);
+
+  std::vector<BranchPredictor *> predictors;
+  std::vector<Simulator *> cores;
+  for (int i = 0; i < numCores; ++i) {
+    BranchPredictor *predictor = new BranchPredictor();
+    predictor->strategy = strategy;
+    Simulator *core = new Simulator(views[i], predictor);
+    core->isSingleStep = isSingleStep;
+    core->verbose = verbose;
+    core->shouldDumpHistory = dumpHistory;
+    core->hartId = i;
+    core->pc = entry;
+    // The top page of the next stack stays clear of this one's guard page
+    core->initStack(stackBaseAddr -
+                        i * (stackSize + 2 * Simulator::STACK_GUARD_SIZE),
+                    stackSize);
+    core->reg[RISCV::REG_TP] = i;
+    if (useTlb)
+      core->mmu = new Mmu(views[i], tlbPolicy);
+    core->initPipeline();
+    predictors.push_back(predictor);
+    cores.push_back(core);
+  }
+  l3->setDram(dram);
+
+  if (quantum > 0) {
+    l3->enableParallelSnoops();
+    SpinBarrier barrier(numCores);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < numCores; ++i) {
+      threads.emplace_back([&, i]() {
+        Simulator *core = cores[i];
+        do {
+          for (uint32_t c = 0; c < quantum && !core->halted; ++c)
+            core->step();
+          l3->drainSnoops(i);
+        } while (!barrier.wait(core->halted));
+        // Snoops queued after the last drain
+        l3->drainSnoops(i);
+      });
+    }
+    for (std::thread &thread : threads)
+      thread.join();
+  } else {
+    int running = numCores;
+    while (running > 0) {
+      for (Simulator *core : cores) {
+        if (!core->halted && !core->step())
+          running--;
       }
     }
   }
-}
\ No newline at end of file
+  l3->printCoherenceStatistics();
+  if (dram)
+    dram->printStatistics();
+
+  for (int i = 0; i < numCores; ++i) {
+    delete cores[i]->mmu;
+    delete cores[i];
+    delete predictors[i];
+    delete l1s[i];
+    delete l2s[i];
+    delete views[i];
+  }
+  delete l3;
+}
+#endif
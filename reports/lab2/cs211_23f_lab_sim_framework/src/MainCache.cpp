@@ -6,25 +6,59 @@
  * Created by He, Hao at 2019-04-27
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
+#include <cmath>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "Cache.h"
 #include "Debug.h"
 #include "MemoryManager.h"
+#include "Shards.h"
+#include "StackDistance.h"
+#include "Trace.h"
+
+struct CacheConfig {
+  uint32_t cacheSize;
+  uint32_t blockSize;
+  uint32_t associativity;
+  bool writeBack;
+  bool writeAllocate;
+};
 
 bool parseParameters(int argc, char **argv);
 void printUsage();
-void simulateCache(std::ofstream &csvFile, uint32_t cacheSize,
-                   uint32_t blockSize, uint32_t associativity, bool writeBack,
-                   bool writeAllocate);
+std::string simulateCache(const MemoryTrace &trace, const CacheConfig &config);
+std::string simulateSharded(const MemoryTrace &trace,
+                            const CacheConfig &config);
+void analyzeStackDistance(const MemoryTrace &trace,
+                          const std::vector<CacheConfig> &configs,
+                          const std::vector<size_t> &indices,
+                          std::vector<std::string> &rows);
+std::string formatRow(const CacheConfig &config, double missRate,
+                      uint64_t totalCycles, double missRateError);
+
+const uint32_t hitLatency = 1;
+const uint32_t missLatency = 8;
 
 bool verbose = false;
 bool isSingleStep = false;
+bool useStackDistance = false;
+double samplingRate = 0; // 0: no sampling
+size_t maxSampledBlocks = 1 << 18;
+int replacementType = LRU;
+bool singleConfig = false; // -c, simulate only this configuration
+CacheConfig config;
+unsigned numThreads = 0; // 0: one per hardware thread
 const char *traceFilePath;
 
 int main(int argc, char **argv) {
@@ -32,14 +66,26 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  // Open CSV file and write header
-  std::ofstream csvFile(std::string(traceFilePath) + ".csv");
-  csvFile << "cacheSize,blockSize,associativity,writeBack,writeAllocate,"
-             "missRate,totalCycles\n";
+  // Parse the trace once, every configuration replays the same accesses
+  MemoryTrace trace;
+  if (!trace.open(traceFilePath)) {
+    printf("Unable to open file %s\n", traceFilePath);
+    exit(-1);
+  }
 
+  std::vector<CacheConfig> configs;
+  if (singleConfig) {
+    for (int writeBack = 1; writeBack >= 0; --writeBack) {
+      for (int writeAllocate = 1; writeAllocate >= 0; --writeAllocate) {
+        config.writeBack = writeBack;
+        config.writeAllocate = writeAllocate;
+        configs.push_back(config);
+      }
+    }
+  }
   // Cache Size: 32 Kb to 32 Mb
-  for (uint32_t cacheSize = 32 * 1024; cacheSize <= 32 * 1024 * 1024;
-       cacheSize *= 2) {
+  for (uint32_t cacheSize = 32 * 1024;
+       !singleConfig && cacheSize <= 32 * 1024 * 1024; cacheSize *= 2) {
     // Block Size: 1 byte to 4096 byte
     // The maximum block size is imposed by VM page size
     for (uint32_t blockSize = 1; blockSize <= 4096; blockSize *= 2) {
@@ -49,14 +95,75 @@ int main(int argc, char **argv) {
         if (blockNum % associativity != 0)
           continue;
 
-        simulateCache(csvFile, cacheSize, blockSize, associativity, true, true);
-        simulateCache(csvFile, cacheSize, blockSize, associativity, true, false);
-        simulateCache(csvFile, cacheSize, blockSize, associativity, false, true);
-        simulateCache(csvFile, cacheSize, blockSize, associativity, false, false);
+        configs.push_back({cacheSize, blockSize, associativity, true, true});
+        configs.push_back({cacheSize, blockSize, associativity, true, false});
+        configs.push_back({cacheSize, blockSize, associativity, false, true});
+        configs.push_back({cacheSize, blockSize, associativity, false, false});
       }
     }
   }
 
+  // Configurations are independent, workers claim the next unfinished task
+  // until all are done, rows are kept by index so the CSV order is fixed
+  if (verbose || isSingleStep)
+    numThreads = 1;
+  if (numThreads == 0)
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::string> rows(configs.size());
+  std::vector<std::function<void()>> tasks;
+  std::vector<std::vector<size_t>> stackGroups;
+  for (size_t i = 0; i < configs.size(); ++i) {
+    // One configuration is split by sets over all the workers instead
+    if (singleConfig) {
+      rows[i] = simulateSharded(trace, configs[i]);
+      continue;
+    }
+    // With -d, the write allocate LRU configurations of one block size are
+    // all covered by a single stack distance pass
+    if (useStackDistance && configs[i].writeAllocate) {
+      size_t g = 0;
+      while (g < stackGroups.size() &&
+             configs[stackGroups[g][0]].blockSize != configs[i].blockSize)
+        g++;
+      if (g == stackGroups.size())
+        stackGroups.push_back(std::vector<size_t>());
+      stackGroups[g].push_back(i);
+      continue;
+    }
+    tasks.push_back([&, i]() { rows[i] = simulateCache(trace, configs[i]); });
+  }
+  for (const auto &group : stackGroups) {
+    tasks.push_back([&, group]() {
+      analyzeStackDistance(trace, configs, group, rows);
+    });
+  }
+  // The stack distance passes are the longest tasks, start them first
+  std::reverse(tasks.begin(), tasks.end());
+
+  std::atomic<size_t> nextTask(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = nextTask.fetch_add(1)) < tasks.size())
+      tasks[i]();
+  };
+  if (numThreads == 1) {
+    worker();
+  } else {
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < numThreads; ++i)
+      workers.emplace_back(worker);
+    for (auto &t : workers)
+      t.join();
+  }
+
+  // Open CSV file and write header
+  std::ofstream csvFile(std::string(traceFilePath) + ".csv");
+  csvFile << "cacheSize,blockSize,associativity,writeBack,writeAllocate,"
+             "missRate,totalCycles";
+  csvFile << (samplingRate > 0 ? ",missRateError\n" : "\n");
+  for (const auto &row : rows)
+    csvFile << row;
+
   printf("Result has been written to %s\n",
          (std::string(traceFilePath) + ".csv").c_str());
   csvFile.close();
@@ -74,6 +181,59 @@ bool parseParameters(int argc, char **argv) {
       case 's':
         isSingleStep = 1;
         break;
+      case 'd':
+        useStackDistance = true;
+        break;
+      case 'r':
+        // Sampling implies stack distances for write allocate caches
+        if (i + 1 < argc) {
+          samplingRate = atof(argv[++i]);
+          useStackDistance = true;
+          if (!(samplingRate > 0 && samplingRate <= 1))
+            return false;
+        } else {
+          return false;
+        }
+        break;
+      case 'n':
+        if (i + 1 < argc) {
+          maxSampledBlocks = strtoull(argv[++i], nullptr, 0);
+        } else {
+          return false;
+        }
+        break;
+      case 'c':
+        if (i + 3 < argc) {
+          singleConfig = true;
+          config.cacheSize = strtoul(argv[++i], nullptr, 0);
+          config.blockSize = strtoul(argv[++i], nullptr, 0);
+          config.associativity = strtoul(argv[++i], nullptr, 0);
+          if (config.blockSize == 0 || config.associativity == 0 ||
+              config.cacheSize / config.blockSize / config.associativity == 0)
+            return false;
+        } else {
+          return false;
+        }
+        break;
+      case 'p':
+        if (i + 1 < argc) {
+          std::string str = argv[++i];
+          // BELADY needs the trace preprocessed, not done here
+          replacementType = getReplacementTypeFromName(str);
+          if (replacementType < 0 || replacementType == BELADY) {
+            return false;
+          }
+        } else {
+          return false;
+        }
+        break;
+      case 'j':
+        if (i + 1 < argc) {
+          numThreads = atoi(argv[++i]);
+        } else {
+          return false;
+        }
+        break;
       default:
         return false;
       }
@@ -88,48 +248,87 @@ bool parseParameters(int argc, char **argv) {
   if (traceFilePath == nullptr) {
     return false;
   }
+  // Stack distances model LRU only
+  if (useStackDistance && (replacementType != LRU || singleConfig)) {
+    return false;
+  }
   return true;
 }
 
 void printUsage() {
-  printf("Usage: CacheSim trace-file [-s] [-v]\n");
-  printf("Parameters: -s single step, -v verbose output\n");
+  printf("Usage: CacheSim trace-file [-s] [-v] [-d] [-r rate] [-n blocks] "
+         "[-c size block assoc] [-p policy] [-j threads]\n");
+  printf("trace-file may be a text trace or a binary trace made by "
+         "ToDirenoTrace -b\n");
+  printf("Parameters: -s single step, -v verbose output, -j number of worker "
+         "threads (default: all hardware threads)\n");
+  printf("\t-d compute write allocate configurations from one LRU stack "
+         "distance pass per block size\n");
+  printf("\t-r rate estimate from a hashed sample of the sets (e.g. 0.01), "
+         "adds a missRateError column (95%% bound), implies -d\n");
+  printf("\t-n blocks cap on the sampled blocks per block size, the rate "
+         "is lowered to stay below it (default %lu)\n",
+         (unsigned long)maxSampledBlocks);
+  printf("\t-c size block assoc simulate only this configuration (the four "
+         "write policies), its sets split over the worker threads\n");
+  printf("\t-p policy replacement policy of simulated caches, LRU, RRIP "
+         "(SRRIP), BRRIP, DRRIP, PLRU, BITLRU, RANDOM, SHIP or HAWKEYE\n");
 }
 
-void simulateCache(std::ofstream &csvFile, uint32_t cacheSize,
-                   uint32_t blockSize, uint32_t associativity, bool writeBack,
-                   bool writeAllocate) {
+// Simulate one configuration and return its CSV row
+std::string simulateCache(const MemoryTrace &trace, const CacheConfig &config) {
+  uint32_t cacheSize = config.cacheSize;
+  uint32_t blockSize = config.blockSize;
+  uint32_t associativity = config.associativity;
+  bool writeBack = config.writeBack;
+  bool writeAllocate = config.writeAllocate;
+
   Cache::Policy policy;
   policy.cacheSize = cacheSize;
   policy.blockSize = blockSize;
   policy.blockNum = cacheSize / blockSize;
   policy.associativity = associativity;
-  policy.hitLatency = 1;
-  policy.missLatency = 8;
+  policy.hitLatency = hitLatency;
+  policy.missLatency = missLatency;
 
-  // Initialize memory and cache
-  MemoryManager *memory = nullptr;
+  // Initialize a tag-only cache, the trace carries no data so no memory
+  // backing is needed
   Cache *cache = nullptr;
-  memory = new MemoryManager();
-  cache = new Cache(memory, policy, nullptr, writeBack, writeAllocate);
-  memory->setCache(cache);
+#ifdef MEMORY_YYX
+  cache = new Cache(nullptr, policy, nullptr, writeBack, writeAllocate, NINE,
+                    nullptr, replacementType, false, -1, -1, true);
+#else
+  cache = new Cache(nullptr, policy, nullptr, writeBack, writeAllocate, true);
+#endif
 
-  cache->printInfo(false);
+  // Per configuration output would interleave between workers
+  bool printResult = numThreads == 1;
+  if (printResult)
+    cache->printInfo(false);
 
-  // Read and execute trace in cache-trace/ folder
-  std::ifstream trace(traceFilePath);
-  if (!trace.is_open()) {
-    printf("Unable to open file %s\n", traceFilePath);
-    exit(-1);
-  }
+  // With sampling only the accesses to sampled sets are simulated, the
+  // accesses and misses of each set feed the estimate
+  uint32_t setCount = policy.blockNum / associativity;
+  uint32_t blockBits = 0;
+  while ((1u << blockBits) < blockSize)
+    blockBits++;
+  SetSampler sampler(samplingRate > 0 ? samplingRate : 1);
+  std::unordered_map<uint32_t, std::pair<uint64_t, uint64_t>> sampledSets;
 
-  char type; //'r' for read, 'w' for write
-  uint32_t addr;
-  while (trace >> type >> std::hex >> addr) {
+  MemoryTrace::Cursor cursor = trace.cursor();
+  MemoryTrace::Access access;
+  while (cursor.read(access)) {
+    char type = access.type;
+    uint64_t addr = access.addr;
+    uint32_t setId = (addr >> blockBits) & (setCount - 1);
+    if (samplingRate > 0 && !sampler.isSampled(setId, setCount))
+      continue;
+    uint32_t numMiss = cache->statistics.numMiss;
     if (verbose)
-      printf("%c %x\n", type, addr);
-    if (!memory->isPageExist(addr))
-      memory->addPage(addr);
+      printf("%c %lx\n", type, addr);
+#ifdef MEMORY_YYX
+    cache->setCurrentPC(access.pc);
+#endif
     switch (type) {
     case 'r':
       cache->getByte(addr);
@@ -142,6 +341,11 @@ void simulateCache(std::ofstream &csvFile, uint32_t cacheSize,
       exit(-1);
     }
 
+    if (samplingRate > 0) {
+      sampledSets[setId].first++;
+      sampledSets[setId].second += cache->statistics.numMiss - numMiss;
+    }
+
     if (verbose)
       cache->printInfo(true);
 
@@ -152,13 +356,209 @@ void simulateCache(std::ofstream &csvFile, uint32_t cacheSize,
   }
 
   // Output Simulation Results
-  cache->printStatistics();
-  float missRate = (float)cache->statistics.numMiss /
-                   (cache->statistics.numHit + cache->statistics.numMiss);
-  csvFile << cacheSize << "," << blockSize << "," << associativity << ","
-          << writeBack << "," << writeAllocate << "," << missRate << ","
-          << cache->statistics.totalCycles << std::endl;
+  if (printResult)
+    cache->printStatistics();
+  std::string row;
+  if (samplingRate > 0) {
+    std::vector<std::pair<uint64_t, uint64_t>> sets;
+    for (const auto &set : sampledSets)
+      sets.push_back(set.second);
+    SampleEstimate estimate =
+        estimateMissRate(sets, setCount, sampler.getRate(setCount));
+    row = formatRow(config, estimate.missRate,
+                    llround(cache->statistics.totalCycles / estimate.rate),
+                    estimate.missRateError);
+  } else {
+    float missRate = (float)cache->statistics.numMiss /
+                     (cache->statistics.numHit + cache->statistics.numMiss);
+    row = formatRow(config, missRate, cache->statistics.totalCycles, -1);
+  }
 
   delete cache;
-  delete memory;
-}
\ No newline at end of file
+  return row;
+}
+
+// Simulate one configuration with its sets split over the worker threads.
+// Sets never interact, so shard k takes the sets whose index is k modulo the
+// shard count and replays them on a cache with that many times fewer sets,
+// the shard bits removed from the set index and the tag kept. Every set
+// behaves as in the full cache, so the merged statistics are exact.
+std::string simulateSharded(const MemoryTrace &trace,
+                            const CacheConfig &config) {
+  uint32_t setCount =
+      config.cacheSize / config.blockSize / config.associativity;
+  // Policies with state shared across sets run in one shard
+  uint32_t shards = 1;
+  bool setsCoupled = replacementType == BRRIP || replacementType == DRRIP ||
+                     replacementType == RANDOM || replacementType == SHIP ||
+                     replacementType == HAWKEYE;
+  while (!setsCoupled && shards * 2 <= numThreads && shards * 2 <= setCount)
+    shards *= 2;
+  uint32_t blockBits = 0, setBits = 0, shardBits = 0;
+  while ((1u << blockBits) < config.blockSize)
+    blockBits++;
+  while ((1u << setBits) < setCount)
+    setBits++;
+  while ((1u << shardBits) < shards)
+    shardBits++;
+
+  Cache::Policy policy;
+  policy.cacheSize = config.cacheSize / shards;
+  policy.blockSize = config.blockSize;
+  policy.blockNum = policy.cacheSize / policy.blockSize;
+  policy.associativity = config.associativity;
+  policy.hitLatency = hitLatency;
+  policy.missLatency = missLatency;
+
+  std::vector<Cache::Statistics> statistics(shards);
+  auto worker = [&](uint32_t shard) {
+#ifdef MEMORY_YYX
+    Cache cache(nullptr, policy, nullptr, config.writeBack,
+                config.writeAllocate, NINE, nullptr, replacementType, false,
+                -1, -1, true);
+#else
+    Cache cache(nullptr, policy, nullptr, config.writeBack,
+                config.writeAllocate, true);
+#endif
+    MemoryTrace::Cursor cursor = trace.cursor();
+    MemoryTrace::Access access;
+    while (cursor.read(access)) {
+      uint64_t blockAddr = access.addr >> blockBits;
+      uint32_t setId = blockAddr & (setCount - 1);
+      if ((setId & (shards - 1)) != shard)
+        continue;
+      uint64_t local = (blockAddr >> setBits) << (setBits - shardBits) |
+                       (setId >> shardBits);
+      uint64_t addr = (local << blockBits) |
+                      (access.addr & (config.blockSize - 1));
+#ifdef MEMORY_YYX
+      cache.setCurrentPC(access.pc);
+#endif
+      switch (access.type) {
+      case 'r':
+        cache.getByte(addr);
+        break;
+      case 'w':
+        cache.setByte(addr, 0);
+        break;
+      default:
+        dbgprintf("Illegal type %c\n", access.type);
+        exit(-1);
+      }
+    }
+    statistics[shard] = cache.statistics;
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t shard = 1; shard < shards; ++shard)
+    workers.emplace_back(worker, shard);
+  worker(0);
+  for (auto &t : workers)
+    t.join();
+
+  Cache::Statistics total = {0, 0, 0, 0, 0};
+  for (const auto &s : statistics) {
+    total.numRead += s.numRead;
+    total.numWrite += s.numWrite;
+    total.numHit += s.numHit;
+    total.numMiss += s.numMiss;
+    total.totalCycles += s.totalCycles;
+  }
+  printf("---------- %u B, %u B blocks, %u-way, %s, %s, %u shards ----------\n",
+         config.cacheSize, config.blockSize, config.associativity,
+         config.writeBack ? "write back" : "write through",
+         config.writeAllocate ? "write allocate" : "no write allocate",
+         shards);
+  printf("Num Read: %d\n", total.numRead);
+  printf("Num Write: %d\n", total.numWrite);
+  printf("Num Hit: %d\n", total.numHit);
+  printf("Num Miss: %d\n", total.numMiss);
+  printf("Total Cycles: %llu\n", (unsigned long long)total.totalCycles);
+
+  float missRate = (float)total.numMiss / (total.numHit + total.numMiss);
+  return formatRow(config, missRate, total.totalCycles, -1);
+}
+
+// Fill the rows of write allocate LRU configurations sharing a block size
+// from one stack distance pass (over sampled sets with -r). Every miss costs
+// missLatency, a write back cache also pays it for each dirty eviction and a
+// write through cache for each write, as in Cache.
+void analyzeStackDistance(const MemoryTrace &trace,
+                          const std::vector<CacheConfig> &configs,
+                          const std::vector<size_t> &indices,
+                          std::vector<std::string> &rows) {
+  uint32_t blockSize = configs[indices[0]].blockSize;
+  std::vector<uint32_t> setCounts;
+  uint32_t maxAssociativity = 1;
+  for (size_t i : indices) {
+    const CacheConfig &config = configs[i];
+    uint32_t setCount =
+        config.cacheSize / config.blockSize / config.associativity;
+    if (std::find(setCounts.begin(), setCounts.end(), setCount) ==
+        setCounts.end())
+      setCounts.push_back(setCount);
+    maxAssociativity = std::max(maxAssociativity, config.associativity);
+  }
+
+  StackDistance stack(blockSize, samplingRate > 0 ? std::vector<uint32_t>()
+                                                  : setCounts,
+                      maxAssociativity);
+  ShardsStackDistance shards(blockSize, setCounts, maxAssociativity,
+                             SetSampler(samplingRate > 0 ? samplingRate : 1),
+                             maxSampledBlocks);
+  MemoryTrace::Cursor cursor = trace.cursor();
+  MemoryTrace::Access access;
+  while (cursor.read(access)) {
+    if (access.type != 'r' && access.type != 'w') {
+      dbgprintf("Illegal type %c\n", access.type);
+      exit(-1);
+    }
+    if (samplingRate > 0)
+      shards.access(access.addr, access.type == 'w');
+    else
+      stack.access(access.addr, access.type == 'w');
+  }
+  stack.finish();
+  shards.finish();
+
+  for (size_t i : indices) {
+    const CacheConfig &config = configs[i];
+    uint32_t setCount =
+        config.cacheSize / config.blockSize / config.associativity;
+    StackDistance::Result result;
+    SampleEstimate estimate;
+    if (samplingRate > 0) {
+      ShardsStackDistance::Result sampled =
+          shards.getResult(setCount, config.associativity);
+      result = sampled.sampled;
+      estimate = sampled.estimate;
+    } else {
+      result = stack.getResult(setCount, config.associativity);
+      estimate.missRate =
+          (float)result.numMiss / (result.numHit + result.numMiss);
+      estimate.missRateError = -1;
+      estimate.rate = 1;
+    }
+    uint64_t totalCycles = result.numHit * hitLatency +
+                           result.numMiss * missLatency +
+                           (config.writeBack ? result.numDirtyEvict
+                                             : result.numWrite) *
+                               missLatency;
+    rows[i] = formatRow(config, estimate.missRate,
+                        llround(totalCycles / estimate.rate),
+                        estimate.missRateError);
+  }
+}
+
+// missRateError < 0: no error column
+std::string formatRow(const CacheConfig &config, double missRate,
+                      uint64_t totalCycles, double missRateError) {
+  std::ostringstream row;
+  row << config.cacheSize << "," << config.blockSize << ","
+      << config.associativity << "," << config.writeBack << ","
+      << config.writeAllocate << "," << (float)missRate << ","
+      << totalCycles;
+  if (missRateError >= 0)
+    row << "," << (float)missRateError;
+  row << std::endl;
+  return row.str();
+}
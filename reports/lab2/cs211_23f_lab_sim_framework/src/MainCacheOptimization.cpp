@@ -14,6 +14,7 @@
 #include "Cache.h"
 #include "Debug.h"
 #include "MemoryManager.h"
+#include "Trace.h"
 
 bool parseParameters(int argc, char **argv);
 void printUsage();
@@ -22,7 +23,7 @@ const char *traceFilePath;
 #ifdef MEMORY_YYX
 int inclusionType = NINE;
 int replacementType = LRU;
-int ifUseVictimCache = false; // 1 :using Victim cache, 2: not use, but for comparison that have same L1 associatity
+int ifUseVictimCache = false; // 1 :using Victim cache, 2: not use, but for comparison that have same L1 associatity, 3: victim cache with LRU order
 #endif
 
 int main(int argc, char **argv) {
@@ -30,6 +31,13 @@ int main(int argc, char **argv) {
     return -1;
   }
 
+  // Text or binary trace, loaded once for Belady and the simulation
+  MemoryTrace trace;
+  if (!trace.open(traceFilePath)) {
+    printf("Unable to open file %s\n", traceFilePath);
+    exit(-1);
+  }
+
   Cache::Policy l1policy, l2policy;
   l1policy.cacheSize = 32 * 1024;
   l1policy.blockSize = 64;
@@ -44,63 +52,56 @@ int main(int argc, char **argv) {
   l2policy.hitLatency = 8;
   l2policy.missLatency = 100;
 
-  // Initialize memory and cache
-  MemoryManager *memory = nullptr;
+  // Initialize tag-only caches, the trace carries no data so no memory
+  // backing is needed
   Cache *l1cache = nullptr, *l2cache = nullptr;
-  memory = new MemoryManager();
 #ifdef MEMORY_YYX
   // l2cache = new Cache(memory, l2policy, nullptr, 1, 1, inclusionType);
   // l1cache = new Cache(memory, l1policy, l2cache, 1, 1, inclusionType);
-  l2cache = new Cache(memory, l2policy, nullptr, 1, 1, inclusionType, nullptr, replacementType);
-  if (1 == ifUseVictimCache){
+  l2cache = new Cache(nullptr, l2policy, nullptr, 1, 1, inclusionType, nullptr, replacementType, false, -1, -1, true);
+  if (1 == ifUseVictimCache || 3 == ifUseVictimCache){
     l1policy.associativity = 1;
-    l1cache = new Cache(memory, l1policy, l2cache, 1, 1, inclusionType, nullptr, replacementType, true, 4, l1policy.hitLatency);
+    l1cache = new Cache(nullptr, l1policy, l2cache, 1, 1, inclusionType, nullptr, replacementType, true, 4, l1policy.hitLatency, true);
     // l1cache = new Cache(memory, l1policy, l2cache, 1, 1, inclusionType, nullptr, replacementType, true, 4, 0);
-    l1cache->victimCacheCapacity = 4;
+    if (3 == ifUseVictimCache)
+      l1cache->setVictimReplacementType(VICTIM_LRU);
   }else{ 
     if (2 == ifUseVictimCache) // for comparison
       l1policy.associativity = 1;
-    l1cache = new Cache(memory, l1policy, l2cache, 1, 1, inclusionType, nullptr, replacementType);
+    l1cache = new Cache(nullptr, l1policy, l2cache, 1, 1, inclusionType, nullptr, replacementType, false, -1, -1, true);
   }  
   l2cache->setUpperCache(l1cache);
   // For Belady
   // printf("hello 1\n");
   if (BELADY == replacementType){
-    l1cache->preInputAddrGlobalBlockIDForBelady(traceFilePath);
-    l2cache->preInputAddrGlobalBlockIDForBelady(traceFilePath);
+    l1cache->preInputAddrGlobalBlockIDForBelady(trace);
+    l2cache->preInputAddrGlobalBlockIDForBelady(trace);
   }
   // printf("done 1\n");
 #else
-  l2cache = new Cache(memory, l2policy);
-  l1cache = new Cache(memory, l1policy, l2cache);
+  l2cache = new Cache(nullptr, l2policy, nullptr, true, true, true);
+  l1cache = new Cache(nullptr, l1policy, l2cache, true, true, true);
 #endif
 
-  memory->setCache(l1cache);
-  // Read and execute trace in cache-trace/ folder
-  std::ifstream trace(traceFilePath);
-  if (!trace.is_open()) {
-    printf("Unable to open file %s\n", traceFilePath);
-    exit(-1);
-  }
-
-  char type; //'r' for read, 'w' for write
-  uint32_t addr;
-  while (trace >> type >> std::hex >> addr) {
+  MemoryTrace::Cursor cursor = trace.cursor();
+  MemoryTrace::Access access;
+  while (cursor.read(access)) {
+    char type = access.type; //'r' for read, 'w' for write
+    uint64_t addr = access.addr;
 #ifdef MEMORY_YYX
+    l1cache->setCurrentPC(access.pc);
     // Belady
     if (BELADY == replacementType){
       l1cache->updateGlobalBlockIDCurrentTime(addr);
       l2cache->updateGlobalBlockIDCurrentTime(addr);
     }    
 #endif    
-    if (!memory->isPageExist(addr))
-      memory->addPage(addr);
     switch (type) {
     case 'r':
-      memory->getByte(addr);
+      l1cache->getByte(addr);
       break;
     case 'w':
-      memory->setByte(addr, 0);
+      l1cache->setByte(addr, 0);
       break;
     default:
       dbgprintf("Illegal type %c\n", type);
@@ -114,7 +115,6 @@ int main(int argc, char **argv) {
 
   delete l1cache;
   delete l2cache;
-  delete memory;
   return 0;
 }
 
@@ -128,8 +128,10 @@ bool parseParameters(int argc, char **argv) {
       printf("You designate a fourth parameter, meaning you are deciding if you are using victim cache\n");
       // TODO
       ifUseVictimCache = atoi(argv[4]);
-      if (ifUseVictimCache > 2){
+      if (ifUseVictimCache > 3){
         fprintf(stderr, "not valid ifUseVictimCache\n");
+      }else if (3 == ifUseVictimCache){
+        printf("you are using the version with LRU victim cache\n");
       }else if (2 == ifUseVictimCache){
         printf("you are using the version without victim cache for comparison\n");
       }else if (1 == ifUseVictimCache){
@@ -158,24 +160,11 @@ bool parseParameters(int argc, char **argv) {
         printf("please input the right inclusion type, range : 0-2, NINE:%d, inclusive:%d, exclusive:%d\n", NINE, INCLUSIVE, EXCLUSIVE);
         return false;
       }
-      if (replacementType >= 0 && replacementType <= 2){
-        switch (replacementType)
-        {
-        case LRU:
-          printf("replacement type: LRU\n");
-          break;
-        case RRIP:
-          printf("replacement type: RRIP\n");
-          break;          
-        case BELADY:
-          printf("replacement type: BELADY\n");
-          break;                  
-        default:
-          break;
-        }
+      if (replacementType >= 0 && replacementType < ReplacementTypeNum){
+        printf("replacement type: %s\n", getReplacementTypeName(replacementType));
         return true;
       }else{
-        printf("please input the right inclusion type, range : 0-2, NINE:%d, inclusive:%d, exclusive:%d\n", NINE, INCLUSIVE, EXCLUSIVE);
+        printf("please input the right replacement type, range : 0-%d, LRU:%d, RRIP:%d, BELADY:%d, BRRIP:%d, DRRIP:%d, PLRU:%d, BITLRU:%d, RANDOM:%d, SHIP:%d, HAWKEYE:%d\n", ReplacementTypeNum - 1, LRU, RRIP, BELADY, BRRIP, DRRIP, PLRU, BITLRU, RANDOM, SHIP, HAWKEYE);
         return false;
       }
 
@@ -5,56 +5,237 @@
 #include "MemoryManager.h"
 #include "Debug.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+static const uint64_t FLAT_SPACE_SIZE = 1ULL << 32;
+// Words of a bitmap with a bit per page of the low 4GB
+static const uint32_t BITMAP_WORDS = (FLAT_SPACE_SIZE >> 12) / 64;
 
 MemoryManager::MemoryManager() {
   this->cache = nullptr;
   for (uint32_t i = 0; i < 1024; ++i) {
     this->memory[i] = nullptr;
   }
+  this->pages = this->memory;
+  this->sparsePages = &this->sparseMemory;
+  this->zeroRegions = &this->ownZeroRegions;
+  this->reservedRegions = &this->ownReservedRegions;
+  this->pageLock = &this->ownPageLock;
+  this->ownDirty.reset(new std::atomic<uint64_t>[BITMAP_WORDS]);
+  for (uint32_t i = 0; i < BITMAP_WORDS; ++i)
+    this->ownDirty[i].store(0, std::memory_order_relaxed);
+  this->dirty = this->ownDirty.get();
+  this->sparseDirty = &this->ownSparseDirty;
+  this->dirtyLock = &this->ownDirtyLock;
+  for (uint32_t i = 0; i < SOFT_TLB_SIZE; ++i)
+    this->softTlb[i].page = SOFT_TLB_INVALID;
+  this->flat = nullptr;
+  this->present = nullptr;
+  this->ownsFlat = false;
+}
+
+MemoryManager::MemoryManager(MemoryManager *memory) {
+  this->cache = nullptr;
+  for (uint32_t i = 0; i < 1024; ++i) {
+    this->memory[i] = nullptr;
+  }
+  this->pages = memory->pages;
+  this->sparsePages = memory->sparsePages;
+  this->zeroRegions = memory->zeroRegions;
+  this->reservedRegions = memory->reservedRegions;
+  this->pageLock = memory->pageLock;
+  this->dirty = memory->dirty;
+  this->sparseDirty = memory->sparseDirty;
+  this->dirtyLock = memory->dirtyLock;
+  for (uint32_t i = 0; i < SOFT_TLB_SIZE; ++i)
+    this->softTlb[i].page = SOFT_TLB_INVALID;
+  this->flat = memory->flat;
+  this->present = memory->present;
+  this->ownsFlat = false;
 }
 
 MemoryManager::~MemoryManager() {
+  // Pages of a view belong to the viewed MemoryManager, its own table is
+  // empty
   for (uint32_t i = 0; i < 1024; ++i) {
-    if (this->memory[i] != nullptr) {
+    PageEntry *table = this->memory[i].load();
+    if (table != nullptr) {
       for (uint32_t j = 0; j < 1024; ++j) {
-        if (this->memory[i][j] != nullptr) {
-          delete[] this->memory[i][j];
-          this->memory[i][j] = nullptr;
+        uint8_t *page = table[j].load();
+        if (page != nullptr && this->flat == nullptr &&
+            !this->isFileMapped(page)) {
+          delete[] page;
         }
       }
-      delete[] this->memory[i];
-      this->memory[i] = nullptr;
+      delete[] table;
+      this->memory[i].store(nullptr);
+    }
+  }
+  for (auto &page : this->sparseMemory) {
+    if (!this->isFileMapped(page.second))
+      delete[] page.second;
+  }
+#ifdef __linux__
+  for (auto &mapping : this->fileMappings)
+    munmap(mapping.first, mapping.second);
+  if (this->ownsFlat) {
+    munmap(this->flat, FLAT_SPACE_SIZE);
+    delete[] this->present;
+  }
+#endif
+}
+
+bool MemoryManager::useFlatSpace(bool hugePages) {
+#ifdef __linux__
+  if (sizeof(void *) < 8 || this->flat != nullptr)
+    return false;
+  for (uint32_t i = 0; i < 1024; ++i) {
+    if (this->pages[i] != nullptr) {
+      dbgprintf("Flat space requested after pages were added!\n");
+      return false;
     }
   }
+  void *space = mmap(nullptr, FLAT_SPACE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (space == MAP_FAILED) {
+    dbgprintf("Fail to reserve the flat guest space!\n");
+    return false;
+  }
+#ifdef MADV_HUGEPAGE
+  if (hugePages)
+    madvise(space, FLAT_SPACE_SIZE, MADV_HUGEPAGE);
+#endif
+  this->flat = (uint8_t *)space;
+  this->present = new std::atomic<uint64_t>[BITMAP_WORDS];
+  for (uint32_t i = 0; i < BITMAP_WORDS; ++i)
+    this->present[i].store(0, std::memory_order_relaxed);
+  this->ownsFlat = true;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool MemoryManager::addPage(uint64_t addr) {
+  if (this->isReserved(addr)) {
+    dbgprintf("Addr 0x%lx is reserved and cannot be added!\n", addr);
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(*this->pageLock);
+  return this->addPageLocked(addr);
 }
 
-bool MemoryManager::addPage(uint32_t addr) {
-  uint32_t i = this->getFirstEntryId(addr);
-  uint32_t j = this->getSecondEntryId(addr);
-  if (this->memory[i] == nullptr) {
-    this->memory[i] = new uint8_t *[1024];
-    memset(this->memory[i], 0, sizeof(uint8_t *) * 1024);
+bool MemoryManager::addPageLocked(uint64_t addr, bool reserved) {
+  if (addr >> 32) {
+    uint8_t *&page = (*this->sparsePages)[addr >> 12];
+    if (page != nullptr) {
+      dbgprintf("Addr 0x%lx already exists and do not need an addPage()!\n",
+                addr);
+      return false;
+    }
+    page = new uint8_t[4096];
+    memset(page, 0, 4096);
+    this->softTlb[(addr >> 12) & (SOFT_TLB_SIZE - 1)].page = SOFT_TLB_INVALID;
+    if (!reserved)
+      this->markDirty(addr);
+    return true;
   }
-  if (this->memory[i][j] == nullptr) {
-    this->memory[i][j] = new uint8_t[4096];
-    memset(this->memory[i][j], 0, 4096);
+  PageEntry &entry = this->getTable(this->getFirstEntryId(addr))
+                         [this->getSecondEntryId(addr)];
+  if (entry.load(std::memory_order_relaxed) == nullptr &&
+      this->flat != nullptr) {
+    // Zero filled by the host kernel on first touch
+    uint64_t page = addr >> 12;
+    entry.store(this->flat + (page << 12), std::memory_order_release);
+    this->present[page >> 6].fetch_or(1ULL << (page & 63),
+                                      std::memory_order_release);
+  } else if (entry.load(std::memory_order_relaxed) == nullptr) {
+    uint8_t *page = new uint8_t[4096];
+    memset(page, 0, 4096);
+    entry.store(page, std::memory_order_release);
+    this->softTlb[(addr >> 12) & (SOFT_TLB_SIZE - 1)].page = SOFT_TLB_INVALID;
   } else {
-    dbgprintf("Addr 0x%x already exists and do not need an addPage()!\n", addr);
+    dbgprintf("Addr 0x%lx already exists and do not need an addPage()!\n", addr);
+    return false;
+  }
+  if (!reserved)
+    this->markDirty(addr);
+  return true;
+}
+
+bool MemoryManager::mapFile(uint64_t addr, int fd, uint64_t offset,
+                            uint64_t len) {
+#ifdef __linux__
+  uint64_t skip = addr & 0xFFF;
+  if ((offset & 0xFFF) != skip || len == 0)
+    return false;
+  uint64_t begin = addr - skip;
+  uint64_t size = (skip + len + 4095) & ~(uint64_t)4095;
+  std::lock_guard<std::mutex> guard(*this->pageLock);
+  for (uint64_t page = begin; page < begin + size; page += 4096) {
+    if (this->isReserved(page) || this->findPageLocked(page) != nullptr)
+      return false;
+  }
+  // Inside the flat backing the file replaces its pages in place
+  bool inFlat = this->flat != nullptr && begin + size <= FLAT_SPACE_SIZE;
+  void *host = mmap(inFlat ? this->flat + begin : nullptr, size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | (inFlat ? MAP_FIXED : 0), fd, offset - skip);
+  if (host == MAP_FAILED) {
+    dbgprintf("Fail to map 0x%lx bytes of file at 0x%lx!\n", len, addr);
     return false;
   }
+  if (!inFlat)
+    this->fileMappings.push_back(std::make_pair((uint8_t *)host, size));
+  for (uint64_t page = begin; page < begin + size; page += 4096) {
+    uint8_t *hostPage = (uint8_t *)host + (page - begin);
+    if (page >> 32) {
+      (*this->sparsePages)[page >> 12] = hostPage;
+    } else {
+      this->getTable(this->getFirstEntryId(page))
+          [this->getSecondEntryId(page)]
+              .store(hostPage, std::memory_order_release);
+      uint64_t number = page >> 12;
+      if (inFlat)
+        this->present[number >> 6].fetch_or(1ULL << (number & 63),
+                                            std::memory_order_release);
+    }
+    this->softTlb[(page >> 12) & (SOFT_TLB_SIZE - 1)].page = SOFT_TLB_INVALID;
+    this->markDirty(page);
+  }
   return true;
+#else
+  return false;
+#endif
+}
+
+bool MemoryManager::isFileMapped(const uint8_t *host) {
+  for (auto &mapping : this->fileMappings) {
+    if (host >= mapping.first && host < mapping.first + mapping.second)
+      return true;
+  }
+  return false;
 }
 
-bool MemoryManager::isPageExist(uint32_t addr) {
+bool MemoryManager::isPageExist(uint64_t addr) {
   return this->isAddrExist(addr);
 }
 
-bool MemoryManager::copyFrom(const void *src, uint32_t dest, uint32_t len) {
+bool MemoryManager::copyFrom(const void *src, uint64_t dest, uint32_t len) {
+  // Without a cache nothing is counted, copy a page at a time
+  if (this->cache == nullptr)
+    return this->setBytesNoCache(dest, (const uint8_t *)src, len);
   for (uint32_t i = 0; i < len; ++i) {
     if (!this->isAddrExist(dest + i)) {
-      dbgprintf("Data copy to invalid addr 0x%x!\n", dest + i);
+      dbgprintf("Data copy to invalid addr 0x%lx!\n", dest + i);
       return false;
     }
     this->setByte(dest + i, ((uint8_t *)src)[i]);
@@ -62,141 +243,192 @@ bool MemoryManager::copyFrom(const void *src, uint32_t dest, uint32_t len) {
   return true;
 }
 
-bool MemoryManager::setByte(uint32_t addr, uint8_t val, uint32_t *cycles) {
-  if (!this->isAddrExist(addr)) {
-    dbgprintf("Byte write to invalid addr 0x%x!\n", addr);
+bool MemoryManager::setByte(uint64_t addr, uint8_t val, uint32_t *cycles) {
+  uint8_t *page = this->getHostPage(addr);
+  if (page == nullptr) {
+    dbgprintf("Byte write to invalid addr 0x%lx!\n", addr);
     return false;
   }
   if (this->cache != nullptr) {
     this->cache->setByte(addr, val, cycles);
+    this->markDirty(addr);
     return true;
   }
-
-  uint32_t i = this->getFirstEntryId(addr);
-  uint32_t j = this->getSecondEntryId(addr);
-  uint32_t k = this->getPageOffset(addr);
-  this->memory[i][j][k] = val;
+  page[this->getPageOffset(addr)] = val;
+  this->markDirty(addr);
   return true;
 }
 
-bool MemoryManager::setByteNoCache(uint32_t addr, uint8_t val) {
-  if (!this->isAddrExist(addr)) {
-    dbgprintf("Byte write to invalid addr 0x%x!\n", addr);
+bool MemoryManager::setByteNoCache(uint64_t addr, uint8_t val) {
+  uint8_t *page = this->getHostPage(addr);
+  if (page == nullptr) {
+    dbgprintf("Byte write to invalid addr 0x%lx!\n", addr);
     return false;
   }
-
-  uint32_t i = this->getFirstEntryId(addr);
-  uint32_t j = this->getSecondEntryId(addr);
-  uint32_t k = this->getPageOffset(addr);
-  this->memory[i][j][k] = val;
+  page[this->getPageOffset(addr)] = val;
+  this->markDirty(addr);
   return true;
 }
 
-uint8_t MemoryManager::getByte(uint32_t addr, uint32_t *cycles) {
-  if (!this->isAddrExist(addr)) {
-    dbgprintf("Byte read to invalid addr 0x%x!\n", addr);
+uint8_t MemoryManager::getByte(uint64_t addr, uint32_t *cycles) {
+  uint8_t *page = this->getHostPage(addr);
+  if (page == nullptr) {
+    dbgprintf("Byte read to invalid addr 0x%lx!\n", addr);
     return false;
   }
   if (this->cache != nullptr) {
     return this->cache->getByte(addr, cycles);
   }
-  uint32_t i = this->getFirstEntryId(addr);
-  uint32_t j = this->getSecondEntryId(addr);
-  uint32_t k = this->getPageOffset(addr);
-  return this->memory[i][j][k];
+  return page[this->getPageOffset(addr)];
 }
 
-uint8_t MemoryManager::getByteNoCache(uint32_t addr) {
-  if (!this->isAddrExist(addr)) {
-    dbgprintf("Byte read to invalid addr 0x%x!\n", addr);
+uint8_t MemoryManager::getByteNoCache(uint64_t addr) {
+  uint8_t *page = this->getHostPage(addr);
+  if (page == nullptr) {
+    dbgprintf("Byte read to invalid addr 0x%lx!\n", addr);
     return false;
   }
-  uint32_t i = this->getFirstEntryId(addr);
-  uint32_t j = this->getSecondEntryId(addr);
-  uint32_t k = this->getPageOffset(addr);
-  return this->memory[i][j][k];
+  return page[this->getPageOffset(addr)];
 }
 
-bool MemoryManager::setShort(uint32_t addr, uint16_t val, uint32_t *cycles) {
-  if (!this->isAddrExist(addr)) {
-    dbgprintf("Short write to invalid addr 0x%x!\n", addr);
+bool MemoryManager::getBytes(uint64_t addr, uint8_t *buf, uint32_t len,
+                             uint32_t *cycles) {
+  if (!this->isAddrExist(addr) || !this->isAddrExist(addr + len - 1)) {
+    dbgprintf("Read of %u bytes to invalid addr 0x%lx!\n", len, addr);
     return false;
   }
-  this->setByte(addr, val & 0xFF, cycles);
-  this->setByte(addr + 1, (val >> 8) & 0xFF);
-  return true;
+  if (this->cache != nullptr) {
+    this->cache->getBytes(addr, buf, len, cycles);
+    return true;
+  }
+  return this->getBytesNoCache(addr, buf, len);
 }
 
-uint16_t MemoryManager::getShort(uint32_t addr, uint32_t *cycles) {
-  uint32_t b1 = this->getByte(addr, cycles);
-  uint32_t b2 = this->getByte(addr + 1);
-  return b1 + (b2 << 8);
+bool MemoryManager::setBytes(uint64_t addr, const uint8_t *buf, uint32_t len,
+                             uint32_t *cycles) {
+  if (!this->isAddrExist(addr) || !this->isAddrExist(addr + len - 1)) {
+    dbgprintf("Write of %u bytes to invalid addr 0x%lx!\n", len, addr);
+    return false;
+  }
+  if (this->cache != nullptr) {
+    this->cache->setBytes(addr, buf, len, cycles);
+    this->markDirty(addr);
+    this->markDirty(addr + len - 1);
+    return true;
+  }
+  return this->setBytesNoCache(addr, buf, len);
 }
 
-bool MemoryManager::setInt(uint32_t addr, uint32_t val, uint32_t *cycles) {
-  if (!this->isAddrExist(addr)) {
-    dbgprintf("Int write to invalid addr 0x%x!\n", addr);
-    return false;
+bool MemoryManager::setBytesNoCache(uint64_t addr, const uint8_t *buf,
+                                    uint32_t len) {
+  // Copy page by page
+  uint32_t done = 0;
+  while (done < len) {
+    uint64_t cur = addr + done;
+    uint8_t *page = this->getHostPage(cur);
+    if (page == nullptr) {
+      dbgprintf("Write of %u bytes to invalid addr 0x%lx!\n", len, cur);
+      return false;
+    }
+    uint32_t chunk = 4096 - this->getPageOffset(cur);
+    if (chunk > len - done)
+      chunk = len - done;
+    memcpy(&page[this->getPageOffset(cur)], buf + done, chunk);
+    this->markDirty(cur);
+    done += chunk;
   }
-  this->setByte(addr, val & 0xFF, cycles);
-  this->setByte(addr + 1, (val >> 8) & 0xFF);
-  this->setByte(addr + 2, (val >> 16) & 0xFF);
-  this->setByte(addr + 3, (val >> 24) & 0xFF);
   return true;
 }
 
-uint32_t MemoryManager::getInt(uint32_t addr, uint32_t *cycles) {
-  uint32_t b1 = this->getByte(addr, cycles);
-  uint32_t b2 = this->getByte(addr + 1);
-  uint32_t b3 = this->getByte(addr + 2);
-  uint32_t b4 = this->getByte(addr + 3);
-  return b1 + (b2 << 8) + (b3 << 16) + (b4 << 24);
+bool MemoryManager::getBytesNoCache(uint64_t addr, uint8_t *buf,
+                                    uint32_t len) {
+  uint32_t done = 0;
+  while (done < len) {
+    uint64_t cur = addr + done;
+    uint8_t *page = this->getHostPage(cur);
+    if (page == nullptr) {
+      dbgprintf("Read of %u bytes to invalid addr 0x%lx!\n", len, cur);
+      return false;
+    }
+    uint32_t chunk = 4096 - this->getPageOffset(cur);
+    if (chunk > len - done)
+      chunk = len - done;
+    memcpy(buf + done, &page[this->getPageOffset(cur)], chunk);
+    done += chunk;
+  }
+  return true;
 }
 
-bool MemoryManager::setLong(uint32_t addr, uint64_t val, uint32_t *cycles) {
-  if (!this->isAddrExist(addr)) {
-    dbgprintf("Long write to invalid addr 0x%x!\n", addr);
-    return false;
+bool MemoryManager::setShort(uint64_t addr, uint16_t val, uint32_t *cycles) {
+  uint8_t buf[2];
+  for (uint32_t i = 0; i < 2; ++i) {
+    buf[i] = (val >> (8 * i)) & 0xFF;
   }
-  this->setByte(addr, val & 0xFF, cycles);
-  this->setByte(addr + 1, (val >> 8) & 0xFF);
-  this->setByte(addr + 2, (val >> 16) & 0xFF);
-  this->setByte(addr + 3, (val >> 24) & 0xFF);
-  this->setByte(addr + 4, (val >> 32) & 0xFF);
-  this->setByte(addr + 5, (val >> 40) & 0xFF);
-  this->setByte(addr + 6, (val >> 48) & 0xFF);
-  this->setByte(addr + 7, (val >> 56) & 0xFF);
-  return true;
+  return this->setBytes(addr, buf, 2, cycles);
 }
 
-uint64_t MemoryManager::getLong(uint32_t addr, uint32_t *cycles) {
-  uint64_t b1 = this->getByte(addr, cycles);
-  uint64_t b2 = this->getByte(addr + 1);
-  uint64_t b3 = this->getByte(addr + 2);
-  uint64_t b4 = this->getByte(addr + 3);
-  uint64_t b5 = this->getByte(addr + 4);
-  uint64_t b6 = this->getByte(addr + 5);
-  uint64_t b7 = this->getByte(addr + 6);
-  uint64_t b8 = this->getByte(addr + 7);
-  return b1 + (b2 << 8) + (b3 << 16) + (b4 << 24) + (b5 << 32) + (b6 << 40) +
-         (b7 << 48) + (b8 << 56);
+uint16_t MemoryManager::getShort(uint64_t addr, uint32_t *cycles) {
+  uint8_t buf[2] = {0};
+  this->getBytes(addr, buf, 2, cycles);
+  return buf[0] + (buf[1] << 8);
+}
+
+bool MemoryManager::setInt(uint64_t addr, uint32_t val, uint32_t *cycles) {
+  uint8_t buf[4];
+  for (uint32_t i = 0; i < 4; ++i) {
+    buf[i] = (val >> (8 * i)) & 0xFF;
+  }
+  return this->setBytes(addr, buf, 4, cycles);
+}
+
+uint32_t MemoryManager::getInt(uint64_t addr, uint32_t *cycles) {
+  uint8_t buf[4] = {0};
+  this->getBytes(addr, buf, 4, cycles);
+  uint32_t val = 0;
+  for (uint32_t i = 0; i < 4; ++i) {
+    val |= (uint32_t)buf[i] << (8 * i);
+  }
+  return val;
+}
+
+bool MemoryManager::setLong(uint64_t addr, uint64_t val, uint32_t *cycles) {
+  uint8_t buf[8];
+  for (uint32_t i = 0; i < 8; ++i) {
+    buf[i] = (val >> (8 * i)) & 0xFF;
+  }
+  return this->setBytes(addr, buf, 8, cycles);
+}
+
+uint64_t MemoryManager::getLong(uint64_t addr, uint32_t *cycles) {
+  uint8_t buf[8] = {0};
+  this->getBytes(addr, buf, 8, cycles);
+  uint64_t val = 0;
+  for (uint32_t i = 0; i < 8; ++i) {
+    val |= (uint64_t)buf[i] << (8 * i);
+  }
+  return val;
 }
 
 void MemoryManager::printInfo() {
   printf("Memory Pages: \n");
   for (uint32_t i = 0; i < 1024; ++i) {
-    if (this->memory[i] == nullptr) {
+    if (this->pages[i] == nullptr) {
       continue;
     }
     printf("0x%x-0x%x:\n", i << 22, (i + 1) << 22);
     for (uint32_t j = 0; j < 1024; ++j) {
-      if (this->memory[i][j] == nullptr) {
+      if (this->pages[i][j] == nullptr ||
+          this->isReserved((i << 22) + (j << 12))) {
         continue;
       }
       printf("  0x%x-0x%x\n", (i << 22) + (j << 12),
              (i << 22) + ((j + 1) << 12));
     }
   }
+  for (uint64_t page : this->getSparsePageNumbers()) {
+    if (!this->isReserved(page << 12))
+      printf("  0x%lx-0x%lx\n", page << 12, (page + 1) << 12);
+  }
 }
 
 void MemoryManager::printStatistics() {
@@ -204,52 +436,204 @@ void MemoryManager::printStatistics() {
   this->cache->printStatistics();
 }
 
-std::string MemoryManager::dumpMemory() {
-  char buf[65536];
-  std::string dump;
-
-  dump += "Memory Pages: \n";
+void MemoryManager::dumpMemory(SnapshotWriter *writer, bool withCaches) {
   for (uint32_t i = 0; i < 1024; ++i) {
-    if (this->memory[i] == nullptr) {
+    if (this->pages[i] == nullptr) {
       continue;
     }
-    sprintf(buf, "0x%x-0x%x:\n", i << 22, (i + 1) << 22);
-    dump += buf;
     for (uint32_t j = 0; j < 1024; ++j) {
-      if (this->memory[i][j] == nullptr) {
-        continue;
-      }
-      sprintf(buf, "  0x%x-0x%x\n", (i << 22) + (j << 12),
-              (i << 22) + ((j + 1) << 12));
-      dump += buf;
-
-      for (uint32_t k = 0; k < 1024; ++k) {
-        sprintf(buf, "    0x%x: 0x%x\n", (i << 22) + (j << 12) + k,
-                this->memory[i][j][k]);
-        dump += buf;
+      if (this->pages[i][j] != nullptr) {
+        this->writePage(writer, (i << 22) + (j << 12), this->pages[i][j],
+                        withCaches);
       }
     }
   }
-  return dump;
+  for (uint64_t page : this->getSparsePageNumbers()) {
+    this->writePage(writer, page << 12, this->findPage(page << 12),
+                    withCaches);
+  }
+}
+
+// Reserved pages are not the program's and are left out
+void MemoryManager::writePage(SnapshotWriter *writer, uint64_t addr,
+                              const uint8_t *page, bool withCaches) {
+  if (this->isReserved(addr))
+    return;
+  uint8_t buf[4096];
+  if (withCaches && this->cache != nullptr) {
+    memcpy(buf, page, 4096);
+    if (this->cache->peek(addr, buf, 4096))
+      page = buf;
+  }
+  writer->writePage(addr, page);
+}
+
+void MemoryManager::dumpDirtyPages(SnapshotWriter *writer) {
+  for (uint32_t w = 0; w < BITMAP_WORDS; ++w) {
+    uint64_t bits = this->dirty[w].exchange(0, std::memory_order_relaxed);
+    while (bits) {
+      uint64_t page = (uint64_t)w * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      this->writePage(writer, page << 12, this->findPage(page << 12), true);
+    }
+  }
+  std::vector<uint64_t> sparse;
+  {
+    std::lock_guard<std::mutex> guard(*this->dirtyLock);
+    sparse.assign(this->sparseDirty->begin(), this->sparseDirty->end());
+    this->sparseDirty->clear();
+  }
+  std::sort(sparse.begin(), sparse.end());
+  for (uint64_t page : sparse) {
+    this->writePage(writer, page << 12, this->findPage(page << 12), true);
+  }
+}
+
+void MemoryManager::clearDirtyPages() {
+  for (uint32_t w = 0; w < BITMAP_WORDS; ++w)
+    this->dirty[w].store(0, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> guard(*this->dirtyLock);
+  this->sparseDirty->clear();
+}
+
+std::vector<uint64_t> MemoryManager::getSparsePageNumbers() {
+  std::vector<uint64_t> numbers;
+  std::lock_guard<std::mutex> guard(*this->pageLock);
+  for (const auto &page : *this->sparsePages)
+    numbers.push_back(page.first);
+  std::sort(numbers.begin(), numbers.end());
+  return numbers;
 }
 
-uint32_t MemoryManager::getFirstEntryId(uint32_t addr) {
+uint32_t MemoryManager::getFirstEntryId(uint64_t addr) {
   return (addr >> 22) & 0x3FF;
 }
 
-uint32_t MemoryManager::getSecondEntryId(uint32_t addr) {
+uint32_t MemoryManager::getSecondEntryId(uint64_t addr) {
   return (addr >> 12) & 0x3FF;
 }
 
-uint32_t MemoryManager::getPageOffset(uint32_t addr) { return addr & 0xFFF; }
+uint32_t MemoryManager::getPageOffset(uint64_t addr) { return addr & 0xFFF; }
 
-bool MemoryManager::isAddrExist(uint32_t addr) {
-  uint32_t i = this->getFirstEntryId(addr);
-  uint32_t j = this->getSecondEntryId(addr);
-  if (memory[i] && memory[i][j]) {
-    return true;
+bool MemoryManager::isAddrExist(uint64_t addr) {
+  return this->getHostPage(addr) != nullptr;
+}
+
+uint8_t *MemoryManager::refillSoftTlb(uint64_t addr) {
+  uint8_t *host = this->findPage(addr);
+  if (host == nullptr)
+    host = this->addZeroPage(addr);
+  if (host == nullptr)
+    return nullptr;
+  SoftTlbEntry &entry = this->softTlb[(addr >> 12) & (SOFT_TLB_SIZE - 1)];
+  entry.page = addr >> 12;
+  entry.host = host;
+  return entry.host;
+}
+
+// Host page of addr in the tables, no demand zero
+uint8_t *MemoryManager::findPage(uint64_t addr) {
+  if (addr >> 32) {
+    std::lock_guard<std::mutex> guard(*this->pageLock);
+    return this->findPageLocked(addr);
+  }
+  return this->findPageLocked(addr);
+}
+
+uint8_t *MemoryManager::findPageLocked(uint64_t addr) {
+  uint64_t page = addr >> 12;
+  if (this->flat != nullptr && page < (1ULL << 20)) {
+    uint64_t bits = this->present[page >> 6].load(std::memory_order_acquire);
+    if ((bits >> (page & 63)) & 1)
+      return this->flat + (page << 12);
+    return nullptr;
+  }
+  if (addr >> 32) {
+    auto it = this->sparsePages->find(page);
+    return it == this->sparsePages->end() ? nullptr : it->second;
+  }
+  PageEntry *table =
+      this->pages[this->getFirstEntryId(addr)].load(std::memory_order_acquire);
+  if (table == nullptr)
+    return nullptr;
+  return table[this->getSecondEntryId(addr)].load(std::memory_order_acquire);
+}
+
+MemoryManager::PageEntry *MemoryManager::getTable(uint32_t i) {
+  PageEntry *table = this->pages[i].load(std::memory_order_acquire);
+  if (table == nullptr) {
+    // Filled before it is published
+    table = new PageEntry[1024];
+    for (uint32_t j = 0; j < 1024; ++j)
+      table[j].store(nullptr, std::memory_order_relaxed);
+    this->pages[i].store(table, std::memory_order_release);
+  }
+  return table;
+}
+
+void MemoryManager::addZeroRegion(uint64_t begin, uint64_t end) {
+  this->zeroRegions->push_back(std::make_pair(begin, end));
+}
+
+bool MemoryManager::addReservedRegion(uint64_t begin, uint64_t end) {
+  for (const auto &region : *this->reservedRegions) {
+    if (region.first == begin && region.second == end)
+      return true;
+  }
+  for (const auto &region : *this->zeroRegions) {
+    if (begin < region.second && region.first < end)
+      return false;
+  }
+  for (uint64_t page = begin & ~(uint64_t)0xFFF; page < end; page += 4096) {
+    if (this->findPage(page) != nullptr)
+      return false;
+  }
+  this->reservedRegions->push_back(std::make_pair(begin, end));
+  return true;
+}
+
+bool MemoryManager::isReserved(uint64_t addr) {
+  for (const auto &region : *this->reservedRegions) {
+    if (addr >= region.first && addr < region.second)
+      return true;
   }
   return false;
 }
 
+uint8_t *MemoryManager::addZeroPage(uint64_t addr) {
+  bool reserved = this->isReserved(addr);
+  bool inRegion = reserved;
+  for (const auto &region : *this->zeroRegions) {
+    if (addr >= region.first && addr < region.second) {
+      inRegion = true;
+      break;
+    }
+  }
+  if (!inRegion)
+    return nullptr;
+  // Cores of a parallel run may touch new pages together, the lookup that
+  // found no page was unlocked
+  std::lock_guard<std::mutex> guard(*this->pageLock);
+  uint8_t *host = this->findPageLocked(addr);
+  if (host == nullptr) {
+    this->addPageLocked(addr, reserved);
+    host = this->findPageLocked(addr);
+  }
+  return host;
+}
+
 void MemoryManager::setCache(Cache *cache) { this->cache = cache; }
+
+void MemoryManager::setCurrentPC(uint64_t pc) {
+#ifdef MEMORY_YYX
+  if (this->cache)
+    this->cache->setCurrentPC(pc);
+#endif
+}
+
+void MemoryManager::setCurrentCycle(uint64_t cycle) {
+#ifdef MEMORY_YYX
+  if (this->cache)
+    this->cache->setCurrentCycle(cycle);
+#endif
+}
@@ -6,12 +6,19 @@
 #ifndef MEMORY_MANAGER_H
 #define MEMORY_MANAGER_H
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <unordered_map>
+#include <vector>
 
 #include <elfio/elfio.hpp>
 
 #include "Cache.h"
+#include "Snapshot.h"
 
 class Cache;
 
@@ -19,41 +26,175 @@ class MemoryManager
 {
 public:
   MemoryManager();
+  // A view sharing the pages of memory but with its own cache, one per core
+  // of a multi-core run, memory must outlive it
+  explicit MemoryManager(MemoryManager *memory);
   ~MemoryManager();
 
-  bool addPage(uint32_t addr);
-  bool isPageExist(uint32_t addr);
-
-  bool copyFrom(const void *src, uint32_t dest, uint32_t len);
-
-  bool setByte(uint32_t addr, uint8_t val, uint32_t *cycles = nullptr);
-  bool setByteNoCache(uint32_t addr, uint8_t val);
-  uint8_t getByte(uint32_t addr, uint32_t *cycles = nullptr);
-  uint8_t getByteNoCache(uint32_t addr);
-
-  bool setShort(uint32_t addr, uint16_t val, uint32_t *cycles = nullptr);
-  uint16_t getShort(uint32_t addr, uint32_t *cycles = nullptr);
-
-  bool setInt(uint32_t addr, uint32_t val, uint32_t *cycles = nullptr);
-  uint32_t getInt(uint32_t addr, uint32_t *cycles = nullptr);
-
-  bool setLong(uint32_t addr, uint64_t val, uint32_t *cycles = nullptr);
-  uint64_t getLong(uint32_t addr, uint32_t *cycles = nullptr);
+  // Backs the whole 4GB guest space with a single reservation instead of a
+  // host allocation per page. The host kernel zero fills pages on first
+  // touch, optionally with transparent huge pages, and a guest address
+  // translates with an add. Only before the first addPage, false if the
+  // reservation fails and the paged backing stays
+  bool useFlatSpace(bool hugePages);
+
+  bool addPage(uint64_t addr);
+  // Maps len bytes of the open file fd from offset to addr, copy on write,
+  // instead of copying them in. addr and offset must agree modulo the page
+  // size and the pages must not exist yet, false if they cannot be mapped
+  bool mapFile(uint64_t addr, int fd, uint64_t offset, uint64_t len);
+  // Demand zero: the pages of [begin, end) are added on their first access,
+  // without any cache traffic
+  void addZeroRegion(uint64_t begin, uint64_t end);
+  // Reserves [begin, end) for the simulator's own data, e.g. the page tables
+  // of the TLB model. Its pages come zeroed on their first access like a
+  // demand zero region, but are never marked dirty, listed or dumped, and
+  // the program cannot add pages there. Reserving the same range again does
+  // nothing, false if it overlaps pages or zero regions of the program
+  bool addReservedRegion(uint64_t begin, uint64_t end);
+  bool isPageExist(uint64_t addr);
+
+  // Byte by byte through the cache if there is one, so each byte is counted,
+  // else with a memcpy per page
+  bool copyFrom(const void *src, uint64_t dest, uint32_t len);
+
+  bool setByte(uint64_t addr, uint8_t val, uint32_t *cycles = nullptr);
+  bool setByteNoCache(uint64_t addr, uint8_t val);
+  uint8_t getByte(uint64_t addr, uint32_t *cycles = nullptr);
+  uint8_t getByteNoCache(uint64_t addr);
+
+  // Multi-byte little-endian accesses go to the cache as a single access
+  bool setBytes(uint64_t addr, const uint8_t *buf, uint32_t len,
+                uint32_t *cycles = nullptr);
+  bool getBytes(uint64_t addr, uint8_t *buf, uint32_t len,
+                uint32_t *cycles = nullptr);
+  bool setBytesNoCache(uint64_t addr, const uint8_t *buf, uint32_t len);
+  bool getBytesNoCache(uint64_t addr, uint8_t *buf, uint32_t len);
+
+  bool setShort(uint64_t addr, uint16_t val, uint32_t *cycles = nullptr);
+  uint16_t getShort(uint64_t addr, uint32_t *cycles = nullptr);
+
+  bool setInt(uint64_t addr, uint32_t val, uint32_t *cycles = nullptr);
+  uint32_t getInt(uint64_t addr, uint32_t *cycles = nullptr);
+
+  bool setLong(uint64_t addr, uint64_t val, uint32_t *cycles = nullptr);
+  uint64_t getLong(uint64_t addr, uint32_t *cycles = nullptr);
 
   void printInfo();
   void printStatistics();
 
-  std::string dumpMemory();
+  // Every page in address order, the data of the pages themselves so dirty
+  // blocks still in the caches are not seen, unless withCaches
+  void dumpMemory(SnapshotWriter *writer, bool withCaches = false);
+  // Pages are marked dirty when added or written, also through the caches.
+  // A delta snapshot holds the pages dirtied since the last one (or since
+  // clearDirtyPages() after a base image), as seen through the caches, and
+  // clears their marks
+  void dumpDirtyPages(SnapshotWriter *writer);
+  void clearDirtyPages();
 
   void setCache(Cache *cache);  
+  // PC of the instruction issuing the next accesses, for PC based cache
+  // replacement policies
+  void setCurrentPC(uint64_t pc);
+  // Cycle of the next accesses, for the DRAM timing model
+  void setCurrentCycle(uint64_t cycle);
 
 private:
-  uint32_t getFirstEntryId(uint32_t addr);
-  uint32_t getSecondEntryId(uint32_t addr);
-  uint32_t getPageOffset(uint32_t addr);
-  bool isAddrExist(uint32_t addr);
-
-  uint8_t **memory[1024];
+  // Cores of a parallel run look pages up without a lock while one of them
+  // adds a page under pageLock, tables and pages are published with release
+  // stores
+  typedef std::atomic<uint8_t *> PageEntry;
+
+  uint32_t getFirstEntryId(uint64_t addr);
+  uint32_t getSecondEntryId(uint64_t addr);
+  uint32_t getPageOffset(uint64_t addr);
+  bool isAddrExist(uint64_t addr);
+  // Pages above 4GB in address order
+  std::vector<uint64_t> getSparsePageNumbers();
+  bool isFileMapped(const uint8_t *host);
+
+  // Host page holding addr, nullptr if not mapped. A direct mapped cache of
+  // page number -> host page sits in front of the table or hash lookup,
+  // missing pages are never cached.
+  uint8_t *getHostPage(uint64_t addr) {
+    uint64_t page = addr >> 12;
+    if (this->flat != nullptr && page < (1ULL << 20)) {
+      uint64_t bits = this->present[page >> 6].load(std::memory_order_acquire);
+      if ((bits >> (page & 63)) & 1)
+        return this->flat + ((uint64_t)page << 12);
+      return this->addZeroPage(addr);
+    }
+    const SoftTlbEntry &entry = this->softTlb[page & (SOFT_TLB_SIZE - 1)];
+    if (entry.page == page)
+      return entry.host;
+    return this->refillSoftTlb(addr);
+  }
+  uint8_t *refillSoftTlb(uint64_t addr);
+  void writePage(SnapshotWriter *writer, uint64_t addr, const uint8_t *page,
+                 bool withCaches);
+
+  void markDirty(uint64_t addr) {
+    uint64_t page = addr >> 12;
+    if (page < (1ULL << 20)) {
+      // Test first, most writes go to pages already dirty
+      std::atomic<uint64_t> &word = this->dirty[page >> 6];
+      uint64_t bit = 1ULL << (page & 63);
+      if (!(word.load(std::memory_order_relaxed) & bit))
+        word.fetch_or(bit, std::memory_order_relaxed);
+    } else {
+      std::lock_guard<std::mutex> guard(*this->dirtyLock);
+      this->sparseDirty->insert(page);
+    }
+  }
+  uint8_t *findPage(uint64_t addr);
+  // findPage() and addPage() with pageLock already held, reserved pages are
+  // not marked dirty
+  uint8_t *findPageLocked(uint64_t addr);
+  bool addPageLocked(uint64_t addr, bool reserved = false);
+  // Second level table of entry i, created if missing
+  PageEntry *getTable(uint32_t i);
+  // The page of addr if a zero or reserved region holds it, nullptr otherwise
+  uint8_t *addZeroPage(uint64_t addr);
+  bool isReserved(uint64_t addr);
+
+  static const uint32_t SOFT_TLB_SIZE = 256;
+  static const uint64_t SOFT_TLB_INVALID = UINT64_MAX; // not a page number
+  struct SoftTlbEntry {
+    uint64_t page;
+    uint8_t *host;
+  };
+
+  // The low 4GB, where programs are dense, go through a two level table,
+  // pages above through a hash of page number -> host page
+  std::atomic<PageEntry *> memory[1024];
+  std::unordered_map<uint64_t, uint8_t *> sparseMemory;
+  // Tables in use, memory or the ones of the viewed MemoryManager
+  std::atomic<PageEntry *> *pages;
+  std::unordered_map<uint64_t, uint8_t *> *sparsePages;
+  SoftTlbEntry softTlb[SOFT_TLB_SIZE];
+  // Flat backing, nullptr when paged. The page table then points into it
+  uint8_t *flat;
+  std::atomic<uint64_t> *present; // a bit per 4KB page
+  bool ownsFlat;     // false for a view
+  // Host ranges of mapFile outside the flat backing, unmapped as a whole
+  std::vector<std::pair<uint8_t *, uint64_t>> fileMappings;
+  // Demand zero and reserved regions and the lock adding pages, shared with
+  // views. The lock also guards lookups in the sparse pages
+  std::vector<std::pair<uint64_t, uint64_t>> ownZeroRegions;
+  std::vector<std::pair<uint64_t, uint64_t>> *zeroRegions;
+  std::vector<std::pair<uint64_t, uint64_t>> ownReservedRegions;
+  std::vector<std::pair<uint64_t, uint64_t>> *reservedRegions;
+  std::mutex ownPageLock;
+  std::mutex *pageLock;
+  // Dirty pages, a bit per page of the low 4GB and a set above, shared with
+  // views. The set has its own lock, pages are marked with pageLock held
+  std::unique_ptr<std::atomic<uint64_t>[]> ownDirty;
+  std::unordered_set<uint64_t> ownSparseDirty;
+  std::atomic<uint64_t> *dirty;
+  std::unordered_set<uint64_t> *sparseDirty;
+  std::mutex ownDirtyLock;
+  std::mutex *dirtyLock;
   Cache *cache;
 };
 
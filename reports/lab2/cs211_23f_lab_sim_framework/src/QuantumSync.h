@@ -0,0 +1,105 @@
+/*
+ * Synchronization of host threads simulating one core each
+ *
+ * The cores run a quantum of cycles independently and meet at a spinning
+ * barrier. Invalidations of clean copies a core's private caches receive from
+ * the shared level are queued and applied by the core's own thread at the
+ * quantum boundary. Owners are snooped at once under the core's lock.
+ */
+
+#ifndef QUANTUM_SYNC_H
+#define QUANTUM_SYNC_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+// Sense reversing barrier, wait() also tells whether every thread arrived
+// halted, which stays valid until the next barrier completes
+class SpinBarrier {
+public:
+  explicit SpinBarrier(uint32_t threads) {
+    this->threads = threads;
+    this->arrived = 0;
+    this->halted = 0;
+    this->sense = false;
+    this->allHalted = false;
+  }
+
+  bool wait(bool halted) {
+    bool sense = !this->sense.load(std::memory_order_relaxed);
+    if (halted)
+      this->halted.fetch_add(1, std::memory_order_relaxed);
+    if (this->arrived.fetch_add(1, std::memory_order_acq_rel) ==
+        this->threads - 1) {
+      this->allHalted = this->halted.load(std::memory_order_relaxed) ==
+                        this->threads;
+      this->halted.store(0, std::memory_order_relaxed);
+      this->arrived.store(0, std::memory_order_relaxed);
+      this->sense.store(sense, std::memory_order_release);
+    } else {
+      while (this->sense.load(std::memory_order_acquire) != sense)
+        std::this_thread::yield();
+    }
+    return this->allHalted;
+  }
+
+private:
+  uint32_t threads;
+  std::atomic<uint32_t> arrived;
+  std::atomic<uint32_t> halted;
+  std::atomic<bool> sense;
+  bool allHalted;
+};
+
+struct SnoopRequest {
+  uint64_t addr;
+  bool invalidate;
+  bool byEviction; // the shared level dropped the block
+};
+
+// Unbounded single producer single consumer queue, a linked list behind a
+// dummy node. Producers of one queue must be serialized (they hold the
+// shared level's lock), the core owning the queue consumes.
+class SnoopQueue {
+public:
+  SnoopQueue() { this->head = this->tail = new Node(); }
+  ~SnoopQueue() {
+    while (this->head) {
+      Node *next = this->head->next.load(std::memory_order_relaxed);
+      delete this->head;
+      this->head = next;
+    }
+  }
+  SnoopQueue(const SnoopQueue &) = delete;
+  SnoopQueue &operator=(const SnoopQueue &) = delete;
+
+  void push(const SnoopRequest &request) {
+    Node *node = new Node();
+    node->request = request;
+    this->tail->next.store(node, std::memory_order_release);
+    this->tail = node;
+  }
+
+  bool pop(SnoopRequest &request) {
+    Node *next = this->head->next.load(std::memory_order_acquire);
+    if (next == nullptr)
+      return false;
+    request = next->request;
+    delete this->head;
+    this->head = next;
+    return true;
+  }
+
+private:
+  struct Node {
+    Node() : next(nullptr) {}
+    SnoopRequest request;
+    std::atomic<Node *> next;
+  };
+
+  Node *head; // consumer side
+  Node *tail; // producer side
+};
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * Render a binary memory snapshot (see Snapshot.h) as text, every byte of
+ * every page, or with -s one line per page. A base snapshot may be followed
+ * by deltas, their pages replace those of the earlier files
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "Snapshot.h"
+
+bool parseParameters(int argc, char **argv);
+void printUsage();
+
+std::vector<const char *> snapshotPaths;
+bool summary = false;
+
+struct Page {
+  uint32_t encoding;
+  uint8_t data[Snapshot::PAGE_SIZE];
+};
+
+int main(int argc, char **argv) {
+  if (!parseParameters(argc, argv)) {
+    printUsage();
+    return -1;
+  }
+
+  // Merged in address order, the last file listing a page wins
+  std::map<uint64_t, Page> pages;
+  Page page;
+  uint64_t addr;
+  for (size_t i = 0; i < snapshotPaths.size(); ++i) {
+    SnapshotReader reader;
+    if (!reader.open(snapshotPaths[i]) || (i != 0 && !reader.isDelta())) {
+      printf("Invalid snapshot %s\n", snapshotPaths[i]);
+      return -1;
+    }
+    while (reader.next(&addr, page.data, &page.encoding)) {
+      memcpy(&pages[addr], &page, sizeof(page));
+    }
+    if (reader.isCorrupt()) {
+      printf("Corrupt snapshot %s\n", snapshotPaths[i]);
+      return -1;
+    }
+  }
+
+  const char *encodings[] = {"zero", "rle", "raw"};
+  uint64_t region = UINT64_MAX;
+  printf("Memory Pages: \n");
+  for (auto &entry : pages) {
+    addr = entry.first;
+    // 4MB regions of the low 4GB, as the page table groups them
+    if (addr >> 32 == 0 && addr >> 22 != region) {
+      region = addr >> 22;
+      printf("0x%lx-0x%lx:\n", region << 22, (region + 1) << 22);
+    }
+    if (summary) {
+      printf("  0x%lx-0x%lx %s\n", addr, addr + Snapshot::PAGE_SIZE,
+             encodings[entry.second.encoding]);
+      continue;
+    }
+    printf("  0x%lx-0x%lx\n", addr, addr + Snapshot::PAGE_SIZE);
+    for (uint32_t k = 0; k < Snapshot::PAGE_SIZE; ++k) {
+      printf("    0x%lx: 0x%x\n", addr + k, entry.second.data[k]);
+    }
+  }
+  return 0;
+}
+
+bool parseParameters(int argc, char **argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] == '-') {
+      switch (argv[i][1]) {
+      case 's':
+        summary = true;
+        break;
+      default:
+        return false;
+      }
+    } else {
+      snapshotPaths.push_back(argv[i]);
+    }
+  }
+  return !snapshotPaths.empty();
+}
+
+void printUsage() {
+  printf("Usage: RenderSnapshot snapshot-file [delta-file ...] [-s]\n");
+  printf("Parameters: -s list the pages and their encoding only\n");
+}
@@ -0,0 +1,296 @@
+/*
+ * Pluggable cache replacement policies
+ */
+
+#include "ReplacementPolicy.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "Cache.h"
+
+const uint32_t SHiPPolicy::SHCT_BITS;
+const uint8_t SHiPPolicy::SHCT_MAX;
+const uint8_t SHiPPolicy::RRPV_MAX;
+const uint32_t HawkeyePolicy::PREDICTOR_BITS;
+const uint8_t HawkeyePolicy::PREDICTOR_MAX;
+const uint8_t HawkeyePolicy::RRPV_MAX;
+const uint32_t HawkeyePolicy::SAMPLED_SETS;
+
+// Indexed by ReplacementType
+static const char *replacementTypeNames[] = {
+    "LRU",  "RRIP",   "BELADY", "BRRIP", "DRRIP",
+    "PLRU", "BITLRU", "RANDOM", "SHIP",  "HAWKEYE",
+};
+
+int getReplacementTypeFromName(const std::string &name) {
+  if (name == "SRRIP")
+    return RRIP;
+  for (int i = 0; i < ReplacementTypeNum; ++i) {
+    if (name == replacementTypeNames[i])
+      return i;
+  }
+  return -1;
+}
+
+const char *getReplacementTypeName(int replacementType) {
+  if (replacementType < 0 || replacementType >= ReplacementTypeNum)
+    return "UNKNOWN";
+  return replacementTypeNames[replacementType];
+}
+
+// Table index of a PC, instructions are at least 2 byte aligned
+static inline uint32_t hashPC(uint32_t pc, uint32_t bits) {
+  uint32_t h = pc >> 1;
+  h ^= h >> bits;
+  return h & ((1u << bits) - 1);
+}
+
+ReplacementPolicy::ReplacementPolicy(uint32_t setCount,
+                                     uint32_t associativity) {
+  this->setCount = setCount;
+  this->associativity = associativity;
+}
+
+ReplacementPolicy *ReplacementPolicy::create(int replacementType,
+                                             uint32_t setCount,
+                                             uint32_t associativity) {
+  switch (replacementType) {
+  case PLRU:
+    if ((associativity & (associativity - 1)) != 0) {
+      fprintf(stderr, "PLRU needs a power of 2 associativity\n");
+      exit(-1);
+    }
+    return new TreePLRUPolicy(setCount, associativity);
+  case BITLRU:
+    if (associativity > 64) {
+      fprintf(stderr, "BITLRU supports up to 64 ways\n");
+      exit(-1);
+    }
+    return new BitMatrixLRUPolicy(setCount, associativity);
+  case RANDOM:
+    return new RandomPolicy(setCount, associativity);
+  case SHIP:
+    return new SHiPPolicy(setCount, associativity);
+  case HAWKEYE:
+    if (associativity > 255) {
+      fprintf(stderr, "HAWKEYE supports up to 255 ways\n");
+      exit(-1);
+    }
+    return new HawkeyePolicy(setCount, associativity);
+  default:
+    return nullptr;
+  }
+}
+
+TreePLRUPolicy::TreePLRUPolicy(uint32_t setCount, uint32_t associativity)
+    : ReplacementPolicy(setCount, associativity) {
+  this->bits = std::vector<uint8_t>((size_t)setCount * associativity, 0);
+}
+
+// Point every node on the way's path to the other half
+void TreePLRUPolicy::onAccess(uint32_t set, uint32_t way, uint32_t blockAddr,
+                              uint32_t pc, bool hit) {
+  uint8_t *node = &this->bits[(size_t)set * this->associativity];
+  for (uint32_t n = this->associativity + way; n > 1; n >>= 1)
+    node[n >> 1] = !(n & 1);
+}
+
+uint32_t TreePLRUPolicy::getVictim(uint32_t set) {
+  const uint8_t *node = &this->bits[(size_t)set * this->associativity];
+  uint32_t n = 1;
+  while (n < this->associativity)
+    n = 2 * n + node[n];
+  return n - this->associativity;
+}
+
+BitMatrixLRUPolicy::BitMatrixLRUPolicy(uint32_t setCount,
+                                       uint32_t associativity)
+    : ReplacementPolicy(setCount, associativity) {
+  this->fullRow = associativity == 64 ? ~0ull : (1ull << associativity) - 1;
+  this->rows = std::vector<uint64_t>((size_t)setCount * associativity, 0);
+}
+
+// Set the way's row, then clear its column
+void BitMatrixLRUPolicy::onAccess(uint32_t set, uint32_t way,
+                                  uint32_t blockAddr, uint32_t pc, bool hit) {
+  uint64_t *row = &this->rows[(size_t)set * this->associativity];
+  row[way] = this->fullRow;
+  uint64_t column = ~(1ull << way);
+  for (uint32_t i = 0; i < this->associativity; ++i)
+    row[i] &= column;
+}
+
+uint32_t BitMatrixLRUPolicy::getVictim(uint32_t set) {
+  const uint64_t *row = &this->rows[(size_t)set * this->associativity];
+  for (uint32_t i = 0; i < this->associativity; ++i) {
+    if (row[i] == 0)
+      return i;
+  }
+  return 0;
+}
+
+RandomPolicy::RandomPolicy(uint32_t setCount, uint32_t associativity)
+    : ReplacementPolicy(setCount, associativity) {
+  this->state = 2463534242u;
+}
+
+uint32_t RandomPolicy::getVictim(uint32_t set) {
+  this->state ^= this->state << 13;
+  this->state ^= this->state >> 17;
+  this->state ^= this->state << 5;
+  return this->state % this->associativity;
+}
+
+SHiPPolicy::SHiPPolicy(uint32_t setCount, uint32_t associativity)
+    : ReplacementPolicy(setCount, associativity) {
+  size_t blocks = (size_t)setCount * associativity;
+  // Weakly reused until trained
+  this->shct = std::vector<uint8_t>(1u << SHCT_BITS, 1);
+  this->rrpv = std::vector<uint8_t>(blocks, RRPV_MAX);
+  this->signature = std::vector<uint16_t>(blocks, 0);
+  this->reused = std::vector<uint8_t>(blocks, 0);
+}
+
+void SHiPPolicy::onAccess(uint32_t set, uint32_t way, uint32_t blockAddr,
+                          uint32_t pc, bool hit) {
+  size_t blockId = (size_t)set * this->associativity + way;
+  if (hit) {
+    // Reward the PC that filled the block
+    uint8_t &counter = this->shct[this->signature[blockId]];
+    if (counter < SHCT_MAX)
+      counter++;
+    this->reused[blockId] = 1;
+    this->rrpv[blockId] = 0;
+  } else {
+    uint16_t sig = hashPC(pc, SHCT_BITS);
+    this->signature[blockId] = sig;
+    this->reused[blockId] = 0;
+    this->rrpv[blockId] = this->shct[sig] == 0 ? RRPV_MAX : RRPV_MAX - 1;
+  }
+}
+
+void SHiPPolicy::onEvict(uint32_t set, uint32_t way) {
+  size_t blockId = (size_t)set * this->associativity + way;
+  uint8_t &counter = this->shct[this->signature[blockId]];
+  if (!this->reused[blockId] && counter > 0)
+    counter--;
+}
+
+uint32_t SHiPPolicy::getVictim(uint32_t set) {
+  uint8_t *setRRPV = &this->rrpv[(size_t)set * this->associativity];
+  uint32_t victim = 0;
+  for (uint32_t i = 0; i < this->associativity; ++i) {
+    if (setRRPV[i] > setRRPV[victim])
+      victim = i;
+  }
+  // Age the set until the victim reaches the distant RRPV
+  uint8_t age = RRPV_MAX - setRRPV[victim];
+  if (age > 0) {
+    for (uint32_t i = 0; i < this->associativity; ++i)
+      setRRPV[i] += age;
+  }
+  return victim;
+}
+
+HawkeyePolicy::HawkeyePolicy(uint32_t setCount, uint32_t associativity)
+    : ReplacementPolicy(setCount, associativity) {
+  size_t blocks = (size_t)setCount * associativity;
+  this->history = 8 * associativity;
+  uint32_t sampled = setCount < SAMPLED_SETS ? setCount : SAMPLED_SETS;
+  this->samplingInterval = setCount / sampled;
+  // Weakly cache friendly until trained
+  this->predictor =
+      std::vector<uint8_t>(1u << PREDICTOR_BITS, (PREDICTOR_MAX + 1) / 2);
+  this->samplers = std::vector<Sampler>(sampled);
+  for (Sampler &sampler : this->samplers) {
+    sampler.time = 0;
+    sampler.occupancy = std::vector<uint8_t>(this->history, 0);
+  }
+  this->rrpv = std::vector<uint8_t>(blocks, RRPV_MAX);
+  this->signature = std::vector<uint16_t>(blocks, 0);
+}
+
+void HawkeyePolicy::train(uint16_t signature, bool friendly) {
+  uint8_t &counter = this->predictor[signature];
+  if (friendly && counter < PREDICTOR_MAX)
+    counter++;
+  else if (!friendly && counter > 0)
+    counter--;
+}
+
+// OPT hits the block if it fits into the cache over its whole reuse interval,
+// i.e. fewer than associativity blocks are held at every time in between
+void HawkeyePolicy::runOPTgen(Sampler &sampler, uint32_t blockAddr,
+                              uint16_t signature) {
+  uint32_t now = sampler.time;
+  auto it = sampler.last.find(blockAddr);
+  if (it != sampler.last.end()) {
+    uint32_t then = it->second.first;
+    bool hit = now - then < this->history;
+    for (uint32_t t = then; hit && t != now; ++t) {
+      if (sampler.occupancy[t % this->history] >= this->associativity)
+        hit = false;
+    }
+    if (hit) {
+      for (uint32_t t = then; t != now; ++t)
+        sampler.occupancy[t % this->history]++;
+    }
+    this->train(it->second.second, hit);
+  }
+  sampler.occupancy[now % this->history] = 0;
+  sampler.last[blockAddr] = std::make_pair(now, signature);
+  sampler.time++;
+
+  // Blocks left the window without reuse, OPT would not have kept them
+  if (sampler.last.size() > 2 * this->history) {
+    for (auto e = sampler.last.begin(); e != sampler.last.end();) {
+      if (sampler.time - e->second.first > this->history) {
+        this->train(e->second.second, false);
+        e = sampler.last.erase(e);
+      } else {
+        ++e;
+      }
+    }
+  }
+}
+
+void HawkeyePolicy::onAccess(uint32_t set, uint32_t way, uint32_t blockAddr,
+                             uint32_t pc, bool hit) {
+  uint16_t sig = hashPC(pc, PREDICTOR_BITS);
+  if (set % this->samplingInterval == 0 &&
+      set / this->samplingInterval < this->samplers.size())
+    this->runOPTgen(this->samplers[set / this->samplingInterval], blockAddr,
+                    sig);
+
+  uint8_t *setRRPV = &this->rrpv[(size_t)set * this->associativity];
+  this->signature[(size_t)set * this->associativity + way] = sig;
+  if (this->predictor[sig] <= PREDICTOR_MAX / 2) {
+    setRRPV[way] = RRPV_MAX; // cache averse
+    return;
+  }
+  // A friendly fill ages the other friendly blocks
+  if (!hit) {
+    for (uint32_t i = 0; i < this->associativity; ++i) {
+      if (i != way && setRRPV[i] < RRPV_MAX - 1)
+        setRRPV[i]++;
+    }
+  }
+  setRRPV[way] = 0;
+}
+
+// Evict a cache averse block, or else the oldest friendly one, whose PC is
+// then detrained
+uint32_t HawkeyePolicy::getVictim(uint32_t set) {
+  const uint8_t *setRRPV = &this->rrpv[(size_t)set * this->associativity];
+  uint32_t victim = 0;
+  for (uint32_t i = 0; i < this->associativity; ++i) {
+    if (setRRPV[i] == RRPV_MAX)
+      return i;
+    if (setRRPV[i] > setRRPV[victim])
+      victim = i;
+  }
+  this->train(this->signature[(size_t)set * this->associativity + victim],
+              false);
+  return victim;
+}
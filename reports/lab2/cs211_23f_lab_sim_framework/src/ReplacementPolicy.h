@@ -0,0 +1,145 @@
+/*
+ * Pluggable cache replacement policies
+ *
+ * A policy keeps its own per set state and hears about every access of the
+ * cache it serves: hits and fills through onAccess, replaced blocks through
+ * onEvict. The cache fills invalid ways itself and asks getVictim only when
+ * the set is full. LRU, the RRIP family and BELADY are woven into Cache, the
+ * policies here are created from their ReplacementType (see Cache.h).
+ */
+
+#ifndef REPLACEMENT_POLICY_H
+#define REPLACEMENT_POLICY_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ReplacementPolicy {
+public:
+  ReplacementPolicy(uint32_t setCount, uint32_t associativity);
+  virtual ~ReplacementPolicy() {}
+
+  // blockAddr is the address without the offset bits, pc the instruction
+  // issuing the access (0 if unknown), hit is false for a fill after a miss
+  virtual void onAccess(uint32_t set, uint32_t way, uint32_t blockAddr,
+                        uint32_t pc, bool hit) = 0;
+  // The valid block of way is about to be replaced
+  virtual void onEvict(uint32_t set, uint32_t way) {}
+  virtual uint32_t getVictim(uint32_t set) = 0;
+
+  // nullptr for the types implemented inside Cache, exits if the policy
+  // cannot handle the associativity
+  static ReplacementPolicy *create(int replacementType, uint32_t setCount,
+                                   uint32_t associativity);
+
+protected:
+  uint32_t setCount;
+  uint32_t associativity;
+};
+
+// Command line name of a replacement type and back, -1 if unknown
+int getReplacementTypeFromName(const std::string &name);
+const char *getReplacementTypeName(int replacementType);
+
+// Tree pseudo LRU, associativity - 1 bits per set stored as a heap (node 1 is
+// the root), a bit points to the half holding the next victim
+class TreePLRUPolicy final : public ReplacementPolicy {
+public:
+  TreePLRUPolicy(uint32_t setCount, uint32_t associativity);
+  void onAccess(uint32_t set, uint32_t way, uint32_t blockAddr, uint32_t pc,
+                bool hit) override;
+  uint32_t getVictim(uint32_t set) override;
+
+private:
+  std::vector<uint8_t> bits;
+};
+
+// True LRU as a bit matrix, row w has bit v set when w was used after v, so
+// the least recently used way has an empty row
+class BitMatrixLRUPolicy final : public ReplacementPolicy {
+public:
+  BitMatrixLRUPolicy(uint32_t setCount, uint32_t associativity);
+  void onAccess(uint32_t set, uint32_t way, uint32_t blockAddr, uint32_t pc,
+                bool hit) override;
+  uint32_t getVictim(uint32_t set) override;
+
+private:
+  uint64_t fullRow;
+  std::vector<uint64_t> rows;
+};
+
+// Uniformly random way from a fixed seed xorshift, runs are reproducible
+class RandomPolicy final : public ReplacementPolicy {
+public:
+  RandomPolicy(uint32_t setCount, uint32_t associativity);
+  void onAccess(uint32_t set, uint32_t way, uint32_t blockAddr, uint32_t pc,
+                bool hit) override {}
+  uint32_t getVictim(uint32_t set) override;
+
+private:
+  uint32_t state;
+};
+
+// SHiP-PC over SRRIP: a table of saturating counters indexed by a PC
+// signature learns whether the blocks a PC fills get reused, blocks of PCs
+// without reuse are inserted at the distant RRPV
+class SHiPPolicy final : public ReplacementPolicy {
+public:
+  static const uint32_t SHCT_BITS = 14;
+  static const uint8_t SHCT_MAX = 7;
+  static const uint8_t RRPV_MAX = 3;
+
+  SHiPPolicy(uint32_t setCount, uint32_t associativity);
+  void onAccess(uint32_t set, uint32_t way, uint32_t blockAddr, uint32_t pc,
+                bool hit) override;
+  void onEvict(uint32_t set, uint32_t way) override;
+  uint32_t getVictim(uint32_t set) override;
+
+private:
+  std::vector<uint8_t> shct;
+  // Per block
+  std::vector<uint8_t> rrpv;
+  std::vector<uint16_t> signature;
+  std::vector<uint8_t> reused;
+};
+
+// Hawkeye: OPTgen replays Belady's decisions on a sample of sets over a
+// window of 8 x associativity accesses and trains a PC predictor, blocks of
+// cache friendly PCs are kept in RRPV order, cache averse ones evicted first
+class HawkeyePolicy final : public ReplacementPolicy {
+public:
+  static const uint32_t PREDICTOR_BITS = 13;
+  static const uint8_t PREDICTOR_MAX = 7;
+  static const uint8_t RRPV_MAX = 7;
+  static const uint32_t SAMPLED_SETS = 64;
+
+  HawkeyePolicy(uint32_t setCount, uint32_t associativity);
+  void onAccess(uint32_t set, uint32_t way, uint32_t blockAddr, uint32_t pc,
+                bool hit) override;
+  uint32_t getVictim(uint32_t set) override;
+
+private:
+  struct Sampler {
+    uint32_t time; // accesses to the set so far
+    // Cache blocks OPT holds at each time of the window (circular)
+    std::vector<uint8_t> occupancy;
+    // block addr -> (time, signature) of its latest access
+    std::unordered_map<uint32_t, std::pair<uint32_t, uint16_t>> last;
+  };
+
+  uint32_t history;
+  uint32_t samplingInterval;
+  std::vector<uint8_t> predictor;
+  std::vector<Sampler> samplers;
+  // Per block
+  std::vector<uint8_t> rrpv;
+  std::vector<uint16_t> signature;
+
+  void train(uint16_t signature, bool friendly);
+  void runOPTgen(Sampler &sampler, uint32_t blockAddr, uint16_t signature);
+};
+
+#endif
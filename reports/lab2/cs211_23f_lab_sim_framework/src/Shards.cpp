@@ -0,0 +1,181 @@
+/*
+ * Spatially hashed set sampling (SHARDS applied to cache sets)
+ */
+
+#include "Shards.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <tuple>
+
+const uint64_t SetSampler::HASH_SPACE;
+
+SetSampler::SetSampler(double rate, uint32_t minSampledSets) {
+  if (!(rate > 0 && rate <= 1)) {
+    fprintf(stderr, "Invalid sampling rate %f\n", rate);
+    exit(-1);
+  }
+  this->threshold = (uint64_t)std::ceil(rate * HASH_SPACE);
+  this->minSampledSets = minSampledSets;
+}
+
+uint64_t SetSampler::getThreshold(uint32_t setCount) const {
+  return std::max(this->threshold, this->getMinThreshold(setCount));
+}
+
+// Keep at least minSampledSets sets of a set count sampled
+uint64_t SetSampler::getMinThreshold(uint32_t setCount) const {
+  if (this->minSampledSets >= setCount)
+    return HASH_SPACE;
+  return HASH_SPACE / setCount * this->minSampledSets;
+}
+
+void SetSampler::lowerThreshold(uint64_t threshold) {
+  this->threshold = std::min(this->threshold, threshold);
+}
+
+SampleEstimate
+estimateMissRate(const std::vector<std::pair<uint64_t, uint64_t>> &sets,
+                 uint32_t setCount, double rate) {
+  SampleEstimate estimate;
+  estimate.rate = rate;
+  uint64_t accesses = 0, misses = 0;
+  for (const auto &set : sets) {
+    accesses += set.first;
+    misses += set.second;
+  }
+  estimate.missRate = accesses ? (double)misses / accesses : 0;
+  estimate.missRateError = 0;
+
+  // Variance of the ratio estimator over k sampled sets out of setCount,
+  // (1 - f) k / (k - 1) * sum (m - r n)^2 / N^2
+  double k = std::max((double)sets.size(), rate * setCount);
+  if (rate >= 1 || accesses == 0)
+    return estimate;
+  if (k <= 1) {
+    estimate.missRateError = 1;
+    return estimate;
+  }
+  double sum = 0;
+  for (const auto &set : sets) {
+    double residual = set.second - estimate.missRate * set.first;
+    sum += residual * residual;
+  }
+  double variance =
+      (1 - rate) * k / (k - 1) * sum / ((double)accesses * accesses);
+  estimate.missRateError = 1.96 * std::sqrt(variance);
+  return estimate;
+}
+
+ShardsStackDistance::ShardsStackDistance(uint32_t blockSize,
+                                         const std::vector<uint32_t> &setCounts,
+                                         uint32_t maxAssociativity,
+                                         const SetSampler &sampler,
+                                         size_t maxSampledBlocks)
+    : sampler(sampler) {
+  this->blockBits = 0;
+  while ((1u << this->blockBits) < blockSize)
+    this->blockBits++;
+  this->blockSize = blockSize;
+  this->maxAssociativity = maxAssociativity;
+  this->setCounts = setCounts;
+  this->maxSampledBlocks = maxSampledBlocks;
+  this->numSampledBlocks = 0;
+}
+
+void ShardsStackDistance::access(uint64_t addr, bool isWrite) {
+  uint64_t blockAddr = addr >> this->blockBits;
+  bool grown = false;
+  for (uint32_t l = 0; l < this->setCounts.size(); ++l) {
+    uint32_t setCount = this->setCounts[l];
+    uint32_t h = SetSampler::hash(blockAddr & (setCount - 1));
+    if (h >= this->sampler.getThreshold(setCount))
+      continue;
+    auto key = std::make_pair(h, l);
+    auto it = this->units.find(key);
+    if (it == this->units.end()) {
+      it = this->units
+               .emplace(std::piecewise_construct, std::forward_as_tuple(key),
+                        std::forward_as_tuple(
+                            this->blockSize, std::vector<uint32_t>{setCount},
+                            this->maxAssociativity))
+               .first;
+    }
+    size_t before = it->second.getNumBlocks();
+    it->second.access(addr, isWrite);
+    if (it->second.getNumBlocks() != before) {
+      this->numSampledBlocks++;
+      grown = true;
+    }
+  }
+  if (grown && this->numSampledBlocks > this->maxSampledBlocks)
+    this->shrink();
+}
+
+// Lower the threshold to drop the sets with the largest hashes until the
+// sampled blocks fit the cap again
+void ShardsStackDistance::shrink() {
+  while (this->numSampledBlocks > this->maxSampledBlocks) {
+    // Largest hash above the minimum threshold of its set count
+    auto it = this->units.rbegin();
+    while (it != this->units.rend() &&
+           it->first.first < this->sampler.getMinThreshold(
+                                 this->setCounts[it->first.second]))
+      ++it;
+    if (it == this->units.rend())
+      return;
+    this->sampler.lowerThreshold(it->first.first);
+    for (auto u = this->units.lower_bound(std::make_pair(it->first.first, 0u));
+         u != this->units.end();) {
+      if (u->first.first >=
+          this->sampler.getThreshold(this->setCounts[u->first.second])) {
+        this->numSampledBlocks -= u->second.getNumBlocks();
+        u = this->units.erase(u);
+      } else {
+        ++u;
+      }
+    }
+  }
+}
+
+void ShardsStackDistance::finish() {
+  for (auto &unit : this->units)
+    unit.second.finish();
+}
+
+ShardsStackDistance::Result
+ShardsStackDistance::getResult(uint32_t setCount,
+                               uint32_t associativity) const {
+  uint32_t level = std::find(this->setCounts.begin(), this->setCounts.end(),
+                             setCount) -
+                   this->setCounts.begin();
+  if (level == this->setCounts.size()) {
+    fprintf(stderr, "No sampled result for %d sets\n", setCount);
+    exit(-1);
+  }
+
+  Result result;
+  result.sampled.numRead = 0;
+  result.sampled.numWrite = 0;
+  result.sampled.numHit = 0;
+  result.sampled.numMiss = 0;
+  result.sampled.numDirtyEvict = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> sets;
+  for (const auto &unit : this->units) {
+    if (unit.first.second != level)
+      continue;
+    StackDistance::Result r =
+        unit.second.getResult(setCount, associativity);
+    result.sampled.numRead += r.numRead;
+    result.sampled.numWrite += r.numWrite;
+    result.sampled.numHit += r.numHit;
+    result.sampled.numMiss += r.numMiss;
+    result.sampled.numDirtyEvict += r.numDirtyEvict;
+    sets.push_back(std::make_pair(r.numRead + r.numWrite, r.numMiss));
+  }
+  result.estimate =
+      estimateMissRate(sets, setCount, this->sampler.getRate(setCount));
+  return result;
+}
@@ -0,0 +1,107 @@
+/*
+ * Spatially hashed set sampling (SHARDS applied to cache sets)
+ *
+ * Sets evolve independently in a set associative cache, so simulating only
+ * the sets whose hashed index falls below a threshold gives their exact
+ * behaviour. The miss rate is estimated as the ratio of misses to accesses
+ * over the sampled sets, with a 95% error bound from the variance of that
+ * ratio estimator. Counts scale back by the sampling rate.
+ *
+ * To bound memory, the threshold is lowered whenever the sampled blocks
+ * exceed a cap, dropping the sets with the largest hashes. The threshold only
+ * decreases, so every set left in the sample has been tracked since its first
+ * access. Every set count keeps at least minSampledSets sets (all of them if
+ * it has fewer) whatever the rate.
+ */
+
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "StackDistance.h"
+
+class SetSampler {
+public:
+  // Hash space is [0, 2^32), a set is sampled if its hash is below the
+  // threshold
+  static const uint64_t HASH_SPACE = 1ull << 32;
+
+  explicit SetSampler(double rate = 1.0, uint32_t minSampledSets = 16);
+
+  static inline uint32_t hash(uint32_t setId) {
+    // murmur3 finalizer, a bijection so distinct sets never collide
+    setId ^= setId >> 16;
+    setId *= 0x85ebca6b;
+    setId ^= setId >> 13;
+    setId *= 0xc2b2ae35;
+    setId ^= setId >> 16;
+    return setId;
+  }
+
+  uint64_t getThreshold(uint32_t setCount) const;
+  uint64_t getMinThreshold(uint32_t setCount) const;
+  bool isSampled(uint32_t setId, uint32_t setCount) const {
+    return hash(setId) < this->getThreshold(setCount);
+  }
+  // Fraction of the sets of this set count that are sampled
+  double getRate(uint32_t setCount) const {
+    return (double)this->getThreshold(setCount) / HASH_SPACE;
+  }
+  void lowerThreshold(uint64_t threshold);
+
+private:
+  uint64_t threshold;
+  uint32_t minSampledSets;
+};
+
+struct SampleEstimate {
+  double missRate;
+  double missRateError; // 95% bound
+  double rate;          // sampling rate, divide counts by it
+};
+
+// Ratio estimate over sampled sets given (accesses, misses) of each sampled
+// set with accesses, sampled sets without accesses count as (0, 0)
+SampleEstimate
+estimateMissRate(const std::vector<std::pair<uint64_t, uint64_t>> &sets,
+                 uint32_t setCount, double rate);
+
+// Stack distance analysis (see StackDistance.h) restricted to sampled sets,
+// one StackDistance per sampled (set count, set)
+class ShardsStackDistance {
+public:
+  struct Result {
+    StackDistance::Result sampled; // counts over the sampled sets only
+    SampleEstimate estimate;
+  };
+
+  ShardsStackDistance(uint32_t blockSize,
+                      const std::vector<uint32_t> &setCounts,
+                      uint32_t maxAssociativity, const SetSampler &sampler,
+                      size_t maxSampledBlocks);
+
+  void access(uint64_t addr, bool isWrite);
+  void finish();
+  Result getResult(uint32_t setCount, uint32_t associativity) const;
+
+private:
+  uint32_t blockBits;
+  uint32_t blockSize;
+  uint32_t maxAssociativity;
+  std::vector<uint32_t> setCounts;
+  SetSampler sampler;
+  size_t maxSampledBlocks;
+  size_t numSampledBlocks;
+  // Keyed by (set hash, index in setCounts), ordered so the largest hashes
+  // are dropped first
+  std::map<std::pair<uint32_t, uint32_t>, StackDistance> units;
+
+  void shrink();
+};
+
+#endif
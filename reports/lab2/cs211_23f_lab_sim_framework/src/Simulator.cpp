@@ -64,6 +64,11 @@ Simulator::Simulator(MemoryManager *memory, BranchPredictor *predictor) {
   this->memory = memory;
   this->branchPredictor = predictor;
   this->pc = 0;
+  this->hartId = -1;
+  this->halted = false;
+  this->mmu = nullptr;
+  this->checkpointInterval = 0;
+  this->checkpointCount = 0;
   for (int i = 0; i < REGNUM; ++i) {
     this->reg[i] = 0;
   }
@@ -71,19 +76,25 @@ Simulator::Simulator(MemoryManager *memory, BranchPredictor *predictor) {
 
 Simulator::~Simulator() {}
 
-void Simulator::initStack(uint32_t baseaddr, uint32_t maxSize) {
+void Simulator::initStack(uint64_t baseaddr, uint64_t maxSize) {
   this->reg[REG_SP] = baseaddr;
   this->stackBase = baseaddr;
   this->maximumStackSize = maxSize;
-  for (uint32_t addr = baseaddr; addr > baseaddr - maxSize; addr--) {
-    if (!this->memory->isPageExist(addr)) {
-      this->memory->addPage(addr);
-    }
-    this->memory->setByte(addr, 0);
-  }
+  // The pages of (baseaddr - maxSize, baseaddr] come zeroed on their first
+  // access, the page below is left out as a guard
+  uint64_t begin = (baseaddr - maxSize + 1) & ~(uint64_t)0xFFF;
+  uint64_t end = (baseaddr & ~(uint64_t)0xFFF) + 4096;
+  this->memory->addZeroRegion(begin, end);
 }
 
 void Simulator::simulate() {
+  this->initPipeline();
+  // Main Simulation Loop
+  while (this->step()) {
+  }
+}
+
+void Simulator::initPipeline() {
   // Initialize pipeline registers
   memset(&this->fReg, 0, sizeof(this->fReg));
   memset(&this->fRegNew, 0, sizeof(this->fRegNew));
@@ -99,69 +110,76 @@ void Simulator::simulate() {
   dReg.bubble = true;
   eReg.bubble = true;
   mReg.bubble = true;
+}
 
-  // Main Simulation Loop
-  while (true) {
-    if (this->reg[0] != 0) {
-      // Some instruction might set this register to zero
-      this->reg[0] = 0;
-      // this->panic("Register 0's value is not zero!\n");
-    }
+bool Simulator::step() {
+  if (this->reg[0] != 0) {
+    // Some instruction might set this register to zero
+    this->reg[0] = 0;
+    // this->panic("Register 0's value is not zero!\n");
+  }
 
-    if (this->reg[REG_SP] < this->stackBase - this->maximumStackSize) {
-      this->panic("Stack Overflow!\n");
-    }
+  if (this->reg[REG_SP] < this->stackBase - this->maximumStackSize) {
+    this->panic("Stack Overflow!\n");
+  }
 
-    this->executeWriteBack = false;
-    this->executeWBReg = -1;
-    this->memoryWriteBack = false;
-    this->memoryWBReg = -1;
-
-    // THE EXECUTION ORDER of these functions are important!!!
-    // Changing them will introduce strange bugs
-    this->fetch();
-    this->decode();
-    this->excecute();
-    this->memoryAccess();
-    this->writeBack();
-
-    if (!this->fReg.stall) this->fReg = this->fRegNew;
-    else this->fReg.stall--;
-    if (!this->dReg.stall) this->dReg = this->dRegNew;
-    else this->dReg.stall--;
-    this->eReg = this->eRegNew;
-    this->mReg = this->mRegNew;
-    memset(&this->fRegNew, 0, sizeof(this->fRegNew));
-    memset(&this->dRegNew, 0, sizeof(this->dRegNew));
-    memset(&this->eRegNew, 0, sizeof(this->eRegNew));
-    memset(&this->mRegNew, 0, sizeof(this->mRegNew));
-
-    // The Branch perdiction happens here to avoid strange bugs in branch prediction
-    if (!this->dReg.bubble && !this->dReg.stall && !this->fReg.stall && this->dReg.predictedBranch) {
-      this->pc = this->predictedPC;
-    }
+  this->executeWriteBack = false;
+  this->executeWBReg = -1;
+  this->memoryWriteBack = false;
+  this->memoryWBReg = -1;
+
+  // THE EXECUTION ORDER of these functions are important!!!
+  // Changing them will introduce strange bugs
+  this->fetch();
+  this->decode();
+  this->excecute();
+  this->memoryAccess();
+  this->writeBack();
+
+  if (!this->fReg.stall) this->fReg = this->fRegNew;
+  else this->fReg.stall--;
+  if (!this->dReg.stall) this->dReg = this->dRegNew;
+  else this->dReg.stall--;
+  this->eReg = this->eRegNew;
+  this->mReg = this->mRegNew;
+  memset(&this->fRegNew, 0, sizeof(this->fRegNew));
+  memset(&this->dRegNew, 0, sizeof(this->dRegNew));
+  memset(&this->eRegNew, 0, sizeof(this->eRegNew));
+  memset(&this->mRegNew, 0, sizeof(this->mRegNew));
 
-    this->history.cycleCount++;
-    this->history.regRecord.push_back(this->getRegInfoStr());
-    if (this->history.regRecord.size() >= 100000) { // Avoid using up memory
-      this->history.regRecord.clear();
-      this->history.instRecord.clear();
-    }
+  // The Branch perdiction happens here to avoid strange bugs in branch prediction
+  if (!this->dReg.bubble && !this->dReg.stall && !this->fReg.stall && this->dReg.predictedBranch) {
+    this->pc = this->predictedPC;
+  }
 
-    if (verbose) {
-      this->printInfo();
-    }
+  this->history.cycleCount++;
+  this->history.regRecord.push_back(this->getRegInfoStr());
+  if (this->history.regRecord.size() >= 100000) { // Avoid using up memory
+    this->history.regRecord.clear();
+    this->history.instRecord.clear();
+  }
+  // Once per interval, the cycle count steps back on memory hazards
+  if (this->checkpointInterval != 0 &&
+      this->history.cycleCount >=
+          (uint64_t)(this->checkpointCount + 1) * this->checkpointInterval) {
+    this->writeCheckpoint();
+  }
 
-    if (this->isSingleStep) {
-      printf("Type d to dump memory in dump.txt, press ENTER to continue: ");
-      char ch;
-      while ((ch = getchar()) != '\n') {
-        if (ch == 'd') {
-          this->dumpHistory();
-        }
+  if (verbose) {
+    this->printInfo();
+  }
+
+  if (this->isSingleStep) {
+    printf("Type d to dump history in dump.txt and memory in dump.mem, press "
+           "ENTER to continue: ");
+    char ch;
+    while ((ch = getchar()) != '\n') {
+      if (ch == 'd') {
+        this->dumpHistory();
       }
     }
   }
+  return !this->halted;
 }
 
 void Simulator::fetch() {
@@ -169,6 +187,11 @@ void Simulator::fetch() {
     this->panic("Illegal PC 0x%x!\n", this->pc);
   }
 
+  this->memory->setCurrentPC(this->pc);
+  this->memory->setCurrentCycle(this->history.cycleCount);
+  // Fetch latency is not modelled, ITLB misses are only counted
+  if (this->mmu)
+    this->mmu->translateInstruction(this->pc);
   uint32_t inst = this->memory->getInt(this->pc);
   uint32_t len = 4;
 
@@ -1045,7 +1068,14 @@ void Simulator::memoryAccess() {
 
   bool good = true;
   uint32_t cycles = 0;
+  uint32_t tlbCycles = 0;
 
+  if (writeMem || readMem) {
+    this->memory->setCurrentPC(eRegPC);
+    this->memory->setCurrentCycle(this->history.cycleCount);
+    if (this->mmu)
+      tlbCycles = this->mmu->translateData(out);
+  }
   if (writeMem) {
     switch (memLen) {
     case 1:
@@ -1066,6 +1096,9 @@ void Simulator::memoryAccess() {
   }
 
   if (!good) {
+    uint64_t bottom = this->stackBase - this->maximumStackSize;
+    if ((uint64_t)out < bottom && (uint64_t)out >= bottom - STACK_GUARD_SIZE)
+      this->panic("Stack Overflow!\n");
     this->panic("Invalid Mem Access!\n");
   }
 
@@ -1104,6 +1137,7 @@ void Simulator::memoryAccess() {
     }
   }
 
+  cycles += tlbCycles;
   if (this->fReg.stall == datamem_stall_lock) 
     this->fReg.stall = std::max<uint32_t>(datamem_lat_lower_bound, cycles);
   if (this->dReg.stall == datamem_stall_lock)
@@ -1227,7 +1261,7 @@ int64_t Simulator::handleSystemCall(int64_t op1, int64_t op2) {
   int64_t arg1 = op1; // reg a0
   switch (type) {
   case 0: { // print string
-    uint32_t addr = arg1;
+    uint64_t addr = arg1;
     char ch = this->memory->getByte(addr);
     while (ch != '\0') {
       printf("%c", ch);
@@ -1243,13 +1277,17 @@ int64_t Simulator::handleSystemCall(int64_t op1, int64_t op2) {
     break;
   case 3:
   case 93: // exit
+    if (this->hartId >= 0)
+      printf("Hart %d: ", this->hartId);
     printf("Program exit from an exit() system call\n");
     if (shouldDumpHistory) {
       printf("Dumping history to dump.txt...");
       this->dumpHistory();
     }
     this->printStatistics();
-    exit(0);
+    // The rest of the cycle completes, then step() reports the halt
+    this->halted = true;
+    break;
   case 4: // read char
     scanf(" %c", (char*)&op1);
     break;
@@ -1291,6 +1329,8 @@ void Simulator::printStatistics() {
   printf("Number of Data Hazards: %u\n", this->history.dataHazardCount);
   printf("Number of Memory Hazards: %u\n",
          this->history.memoryHazardCount);
+  if (this->mmu)
+    this->mmu->printStatistics();
   printf("-----------------------------------\n");
   //this->memory->printStatistics();
 }
@@ -1328,7 +1368,15 @@ void Simulator::dumpHistory() {
 
   ofile << "====================== Memory Dump ======================"
         << std::endl;
-  ofile << this->memory->dumpMemory();
+  SnapshotWriter snapshot;
+  if (snapshot.open("dump.mem")) {
+    this->memory->dumpMemory(&snapshot);
+  }
+  if (snapshot.close()) {
+    ofile << "Binary snapshot in dump.mem, see RenderSnapshot" << std::endl;
+  } else {
+    ofile << "Fail to write dump.mem" << std::endl;
+  }
   ofile << "========================================================="
         << std::endl;
   ofile << std::endl;
@@ -1336,6 +1384,25 @@ void Simulator::dumpHistory() {
   ofile.close();
 }
 
+void Simulator::writeCheckpoint() {
+  char path[64];
+  sprintf(path, "checkpoint.%u.mem", this->checkpointCount);
+  SnapshotWriter snapshot;
+  bool delta = this->checkpointCount != 0;
+  if (snapshot.open(path, delta)) {
+    if (delta) {
+      this->memory->dumpDirtyPages(&snapshot);
+    } else {
+      this->memory->dumpMemory(&snapshot, true);
+      this->memory->clearDirtyPages();
+    }
+  }
+  if (!snapshot.close()) {
+    fprintf(stderr, "Fail to write %s\n", path);
+  }
+  this->checkpointCount++;
+}
+
 void Simulator::panic(const char *format, ...) {
   char buf[BUFSIZ];
   va_list args;
@@ -1344,6 +1411,6 @@ void Simulator::panic(const char *format, ...) {
   fprintf(stderr, "%s", buf);
   va_end(args);
   this->dumpHistory();
-  fprintf(stderr, "Execution history and memory dump in dump.txt\n");
+  fprintf(stderr, "Execution history in dump.txt, memory dump in dump.mem\n");
   exit(-1);
 }
@@ -14,6 +14,7 @@
 
 #include "BranchPredictor.h"
 #include "MemoryManager.h"
+#include "Tlb.h"
 
 namespace RISCV {
 
@@ -166,21 +167,37 @@ public:
   bool isSingleStep;
   bool verbose;
   bool shouldDumpHistory;
+  // Hart id of a multi-core run (also placed in tp), -1 for a single core
+  int hartId;
+  // Set once the program called exit()
+  bool halted;
+  // Address translation cost model, nullptr for free translation
+  Mmu *mmu;
   uint64_t pc;
   uint64_t predictedPC; // for branch prediction module, predicted PC destination
   uint64_t anotherPC; // // another possible prediction destination
   uint64_t reg[RISCV::REGNUM];
-  uint32_t stackBase;
-  uint32_t maximumStackSize;
+  uint64_t stackBase;
+  uint64_t maximumStackSize;
   MemoryManager *memory;
   BranchPredictor *branchPredictor;
+  // Cycles between memory checkpoints, 0 for none. checkpoint.0.mem holds
+  // every page, each later one the pages written since the previous one
+  uint32_t checkpointInterval;
 
   Simulator(MemoryManager *memory, BranchPredictor *predictor);
   ~Simulator();
 
-  void initStack(uint32_t baseaddr, uint32_t maxSize);
+  // Unmapped below the stack, accesses there are reported as overflows
+  static const uint64_t STACK_GUARD_SIZE = 4096;
+
+  void initStack(uint64_t baseaddr, uint64_t maxSize);
 
   void simulate();
+  // Cycle by cycle interface used by multi-core runs, step() returns false
+  // once the hart has halted
+  void initPipeline();
+  bool step();
 
   void dumpHistory();
 
@@ -367,7 +384,10 @@ private:
 
   int64_t handleSystemCall(int64_t op1, int64_t op2);
 
+  uint32_t checkpointCount;
+
   std::string getRegInfoStr();
+  void writeCheckpoint();
   void panic(const char *format, ...);
 };
 
@@ -0,0 +1,162 @@
+/*
+ * Binary memory snapshots
+ */
+
+#include "Snapshot.h"
+
+#include <cstring>
+
+const uint16_t Snapshot::VERSION;
+const uint32_t Snapshot::PAGE_SIZE;
+const uint64_t Snapshot::END;
+
+static const char MAGIC[4] = {'M', 'S', 'N', 'P'};
+
+SnapshotWriter::SnapshotWriter() {
+  this->file = nullptr;
+  this->failed = false;
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  if (this->file)
+    fclose(this->file);
+}
+
+bool SnapshotWriter::open(const char *path, bool delta) {
+  this->file = fopen(path, "wb");
+  if (this->file == nullptr)
+    return false;
+  this->buffer.resize(1 << 20);
+  setvbuf(this->file, this->buffer.data(), _IOFBF, this->buffer.size());
+  this->runs.reserve(Snapshot::PAGE_SIZE * 3);
+  Snapshot::FileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = Snapshot::VERSION;
+  header.type = delta ? Snapshot::DELTA : Snapshot::BASE;
+  header.pageSize = Snapshot::PAGE_SIZE;
+  this->write(&header, sizeof(header));
+  return !this->failed;
+}
+
+void SnapshotWriter::writePage(uint64_t addr, const uint8_t *data) {
+  Snapshot::PageHeader header;
+  header.addr = addr;
+  header.runs = 0;
+  this->runs.clear();
+  // Stop encoding once the runs are no smaller than the page
+  for (uint32_t i = 0; i < Snapshot::PAGE_SIZE &&
+                       this->runs.size() < Snapshot::PAGE_SIZE;) {
+    uint32_t length = 1;
+    while (i + length < Snapshot::PAGE_SIZE && data[i + length] == data[i])
+      length++;
+    this->runs.push_back(length & 0xFF);
+    this->runs.push_back(length >> 8);
+    this->runs.push_back(data[i]);
+    header.runs++;
+    i += length;
+  }
+  if (header.runs == 1 && data[0] == 0) {
+    header.encoding = Snapshot::ZERO;
+    header.runs = 0;
+    this->write(&header, sizeof(header));
+  } else if (this->runs.size() < Snapshot::PAGE_SIZE) {
+    header.encoding = Snapshot::RLE;
+    this->write(&header, sizeof(header));
+    this->write(this->runs.data(), this->runs.size());
+  } else {
+    header.encoding = Snapshot::RAW;
+    header.runs = 0;
+    this->write(&header, sizeof(header));
+    this->write(data, Snapshot::PAGE_SIZE);
+  }
+}
+
+bool SnapshotWriter::close() {
+  if (this->file == nullptr)
+    return false;
+  Snapshot::PageHeader header;
+  memset(&header, 0, sizeof(header));
+  header.addr = Snapshot::END;
+  this->write(&header, sizeof(header));
+  if (fclose(this->file) != 0)
+    this->failed = true;
+  this->file = nullptr;
+  return !this->failed;
+}
+
+void SnapshotWriter::write(const void *data, size_t size) {
+  if (fwrite(data, 1, size, this->file) != size)
+    this->failed = true;
+}
+
+SnapshotReader::SnapshotReader() {
+  this->file = nullptr;
+  this->delta = false;
+  this->corrupt = false;
+}
+
+SnapshotReader::~SnapshotReader() {
+  if (this->file)
+    fclose(this->file);
+}
+
+bool SnapshotReader::open(const char *path) {
+  this->file = fopen(path, "rb");
+  if (this->file == nullptr)
+    return false;
+  Snapshot::FileHeader header;
+  if (fread(&header, sizeof(header), 1, this->file) != 1 ||
+      memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != Snapshot::VERSION ||
+      header.pageSize != Snapshot::PAGE_SIZE ||
+      header.type > Snapshot::DELTA)
+    return false;
+  this->delta = header.type == Snapshot::DELTA;
+  return true;
+}
+
+bool SnapshotReader::next(uint64_t *addr, uint8_t *data, uint32_t *encoding) {
+  Snapshot::PageHeader header;
+  if (fread(&header, sizeof(header), 1, this->file) != 1) {
+    // Ends without the END record
+    this->corrupt = true;
+    return false;
+  }
+  if (header.addr == Snapshot::END)
+    return false;
+  *addr = header.addr;
+  *encoding = header.encoding;
+  if (!this->decode(header, data)) {
+    this->corrupt = true;
+    return false;
+  }
+  return true;
+}
+
+bool SnapshotReader::decode(const Snapshot::PageHeader &header,
+                            uint8_t *data) {
+  switch (header.encoding) {
+  case Snapshot::ZERO:
+    memset(data, 0, Snapshot::PAGE_SIZE);
+    return true;
+  case Snapshot::RAW:
+    return fread(data, Snapshot::PAGE_SIZE, 1, this->file) == 1;
+  case Snapshot::RLE: {
+    uint32_t filled = 0;
+    for (uint32_t r = 0; r < header.runs; ++r) {
+      uint8_t run[3];
+      if (fread(run, sizeof(run), 1, this->file) != 1)
+        return false;
+      uint32_t length = run[0] | (run[1] << 8);
+      if (filled + length > Snapshot::PAGE_SIZE)
+        return false;
+      memset(data + filled, run[2], length);
+      filled += length;
+    }
+    return filled == Snapshot::PAGE_SIZE;
+  }
+  default:
+    return false;
+  }
+}
@@ -0,0 +1,97 @@
+/*
+ * Binary memory snapshots, written by dumpHistory() and panics and rendered
+ * as text offline by RenderSnapshot
+ *
+ * Pages are streamed in address order through a buffered file. An all zero
+ * page is only listed, a page is run length encoded when the runs are
+ * smaller than the page, else it is kept raw.
+ *
+ * A BASE snapshot holds every page, a DELTA only the pages written since the
+ * previous snapshot, applied over it in order.
+ *
+ * Binary layout (all integers little endian):
+ *   FileHeader
+ *   page*: PageHeader, payload (ZERO: none, RLE: runs of 3 bytes, a 16 bit
+ *          length then the byte value, RAW: PAGE_SIZE bytes)
+ *   PageHeader with addr END
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+struct Snapshot {
+  enum Encoding {
+    ZERO = 0,
+    RLE = 1,
+    RAW = 2,
+  };
+
+  enum Type {
+    BASE = 0,
+    DELTA = 1,
+  };
+
+  struct FileHeader {
+    char magic[4]; // "MSNP"
+    uint16_t version;
+    uint16_t type;
+    uint32_t pageSize;
+    uint32_t reserved2;
+  };
+
+  struct PageHeader {
+    uint64_t addr; // END after the last page
+    uint32_t encoding;
+    uint32_t runs; // RLE only
+  };
+
+  static const uint16_t VERSION = 1;
+  static const uint32_t PAGE_SIZE = 4096;
+  static const uint64_t END = UINT64_MAX;
+};
+
+class SnapshotWriter {
+public:
+  SnapshotWriter();
+  ~SnapshotWriter();
+
+  bool open(const char *path, bool delta = false);
+  void writePage(uint64_t addr, const uint8_t *data);
+  // Ends the snapshot, false if any write failed
+  bool close();
+
+private:
+  FILE *file;
+  bool failed;
+  std::vector<char> buffer; // stdio buffer
+  std::vector<uint8_t> runs;
+
+  void write(const void *data, size_t size);
+};
+
+class SnapshotReader {
+public:
+  SnapshotReader();
+  ~SnapshotReader();
+
+  bool open(const char *path);
+  bool isDelta() { return this->delta; }
+  // Decode the next page into data, false at the end or on a corrupt file
+  bool next(uint64_t *addr, uint8_t *data, uint32_t *encoding);
+  // Whether next() stopped on a truncated or corrupt record instead of the
+  // END record
+  bool isCorrupt() { return this->corrupt; }
+
+private:
+  FILE *file;
+  bool delta;
+  bool corrupt;
+
+  bool decode(const Snapshot::PageHeader &header, uint8_t *data);
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Single pass LRU analysis (Mattson stack distances)
+ */
+
+#include "StackDistance.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+const uint32_t StackDistance::NONE;
+const uint8_t StackDistance::CLEAN;
+
+StackDistance::StackDistance(uint32_t blockSize,
+                             const std::vector<uint32_t> &setCounts,
+                             uint32_t maxAssociativity) {
+  if (maxAssociativity == 0 || maxAssociativity >= CLEAN - 1) {
+    fprintf(stderr, "Invalid max associativity %d\n", maxAssociativity);
+    exit(-1);
+  }
+  this->blockBits = 0;
+  while ((1u << this->blockBits) < blockSize)
+    this->blockBits++;
+  this->maxAssociativity = maxAssociativity;
+  this->numRead = 0;
+  this->numWrite = 0;
+  this->finished = false;
+  for (uint32_t setCount : setCounts) {
+    Level level;
+    level.setCount = setCount;
+    level.distances = std::vector<uint64_t>(maxAssociativity + 2, 0);
+    level.dirtyEvicts = std::vector<int64_t>(maxAssociativity + 2, 0);
+    this->levels.push_back(level);
+  }
+}
+
+void StackDistance::access(uint64_t addr, bool isWrite) {
+  if (isWrite)
+    this->numWrite++;
+  else
+    this->numRead++;
+
+  uint64_t blockAddr = addr >> this->blockBits;
+  auto it = this->blockIndex.find(blockAddr);
+  uint32_t block;
+  if (it == this->blockIndex.end()) {
+    // First access, place the block in its set of every level
+    block = this->blockIndex.size();
+    this->blockIndex[blockAddr] = block;
+    for (Level &level : this->levels) {
+      uint32_t setId = blockAddr & (level.setCount - 1);
+      auto setIt = level.setIndex.find(setId);
+      if (setIt == level.setIndex.end()) {
+        setIt = level.setIndex.emplace(setId, level.sets.size()).first;
+        Set set;
+        set.time = 0;
+        set.live = 0;
+        level.sets.push_back(set);
+      }
+      level.blockSet.push_back(setIt->second);
+      level.lastTime.push_back(NONE);
+      level.dirtyDistance.push_back(CLEAN);
+    }
+  } else {
+    block = it->second;
+  }
+
+  uint32_t cap = this->maxAssociativity + 1;
+  for (Level &level : this->levels) {
+    Set &set = level.sets[level.blockSet[block]];
+    uint32_t d = cap; // cold miss
+    uint32_t last = level.lastTime[block];
+    if (last != NONE) {
+      d = std::min(this->distance(set, last), cap);
+      // Remove the one of the previous access
+      for (uint32_t i = last + 1; i < set.tree.size(); i += i & -i)
+        set.tree[i]--;
+      set.owner[last] = NONE;
+      set.live--;
+      this->countDirtyEvict(level, level.dirtyDistance[block], d);
+    }
+    level.distances[d]++;
+
+    uint8_t &dirty = level.dirtyDistance[block];
+    if (dirty != CLEAN)
+      dirty = std::max<uint32_t>(dirty, d);
+    if (isWrite)
+      dirty = 0;
+
+    this->insert(level, set, block);
+  }
+}
+
+void StackDistance::finish() {
+  if (this->finished)
+    return;
+  this->finished = true;
+  uint32_t cap = this->maxAssociativity + 1;
+  for (Level &level : this->levels) {
+    for (uint32_t block = 0; block < level.lastTime.size(); ++block) {
+      Set &set = level.sets[level.blockSet[block]];
+      uint32_t d = std::min(this->distance(set, level.lastTime[block]), cap);
+      this->countDirtyEvict(level, level.dirtyDistance[block], d);
+    }
+  }
+}
+
+StackDistance::Result StackDistance::getResult(uint32_t setCount,
+                                               uint32_t associativity) const {
+  const Level *level = nullptr;
+  for (const Level &l : this->levels) {
+    if (l.setCount == setCount)
+      level = &l;
+  }
+  if (level == nullptr || associativity == 0 ||
+      associativity > this->maxAssociativity) {
+    fprintf(stderr, "No stack distance result for %d sets %d ways\n",
+            setCount, associativity);
+    exit(-1);
+  }
+
+  Result result;
+  result.numRead = this->numRead;
+  result.numWrite = this->numWrite;
+  result.numHit = 0;
+  result.numMiss = 0;
+  for (uint32_t d = 0; d < level->distances.size(); ++d) {
+    if (d < associativity)
+      result.numHit += level->distances[d];
+    else
+      result.numMiss += level->distances[d];
+  }
+  int64_t dirtyEvict = 0;
+  for (uint32_t a = 1; a <= associativity; ++a)
+    dirtyEvict += level->dirtyEvicts[a];
+  result.numDirtyEvict = dirtyEvict;
+  return result;
+}
+
+// Number of distinct blocks of the set accessed after time
+uint32_t StackDistance::distance(Set &set, uint32_t time) {
+  uint32_t before = 0;
+  for (uint32_t i = time + 1; i > 0; i -= i & -i)
+    before += set.tree[i];
+  return set.live - before;
+}
+
+void StackDistance::insert(Level &level, Set &set, uint32_t block) {
+  if (set.time == set.owner.size())
+    this->compact(level, set);
+  uint32_t time = set.time++;
+  for (uint32_t i = time + 1; i < set.tree.size(); i += i & -i)
+    set.tree[i]++;
+  set.owner[time] = block;
+  set.live++;
+  level.lastTime[block] = time;
+}
+
+// Renumber the live blocks from 0 in access order and rebuild the tree with
+// room to grow
+void StackDistance::compact(Level &level, Set &set) {
+  uint32_t live = 0;
+  for (uint32_t t = 0; t < set.time; ++t) {
+    uint32_t block = set.owner[t];
+    if (block == NONE)
+      continue;
+    set.owner[live] = block;
+    level.lastTime[block] = live;
+    live++;
+  }
+  uint32_t capacity = std::max(16u, 2 * live + 2);
+  set.owner.resize(capacity);
+  std::fill(set.owner.begin() + live, set.owner.end(), NONE);
+  set.tree.assign(capacity + 1, 0);
+  for (uint32_t i = 1; i <= live; ++i)
+    set.tree[i] = 1;
+  for (uint32_t i = 1; i <= capacity; ++i) {
+    uint32_t j = i + (i & -i);
+    if (j <= capacity)
+      set.tree[j] += set.tree[i];
+  }
+  set.time = live;
+}
+
+// A block last loaded at distance >= A stays until the distance reaches A
+// again, so it is written back dirty for every dirtyDistance < A <= distance
+void StackDistance::countDirtyEvict(Level &level, uint8_t dirtyDistance,
+                                    uint32_t distance) {
+  if (dirtyDistance == CLEAN || dirtyDistance >= distance)
+    return;
+  uint32_t hi = std::min(distance, this->maxAssociativity);
+  if (dirtyDistance + 1u > hi)
+    return;
+  level.dirtyEvicts[dirtyDistance + 1]++;
+  level.dirtyEvicts[hi + 1]--;
+}
@@ -0,0 +1,88 @@
+/*
+ * Single pass LRU analysis (Mattson stack distances)
+ *
+ * For one block size, the per-set LRU stack distance of every access is
+ * measured for several set counts at once. A set associative LRU cache with
+ * A ways hits exactly when the distance is below A, so one trace pass gives
+ * the statistics of every (set count, associativity) pair. Only write
+ * allocate caches obey the stack property, no write allocate caches still
+ * have to be simulated.
+ *
+ * Distances are counted with one Fenwick tree per set over the set's access
+ * times, holding a one at the last access of every block. Trees are
+ * compacted when full, so memory stays proportional to the distinct blocks.
+ */
+
+#ifndef STACK_DISTANCE_H
+#define STACK_DISTANCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+class StackDistance {
+public:
+  struct Result {
+    uint64_t numRead;
+    uint64_t numWrite;
+    uint64_t numHit;
+    uint64_t numMiss;
+    uint64_t numDirtyEvict; // write backs of a write back cache
+  };
+
+  // setCounts must be powers of 2, associativities up to maxAssociativity
+  // are reported
+  StackDistance(uint32_t blockSize, const std::vector<uint32_t> &setCounts,
+                uint32_t maxAssociativity);
+
+  void access(uint64_t addr, bool isWrite);
+  // Account the evictions after the last access of each block, call once
+  // after the trace
+  void finish();
+  Result getResult(uint32_t setCount, uint32_t associativity) const;
+  size_t getNumBlocks() const { return this->blockIndex.size(); }
+
+private:
+  static const uint32_t NONE = UINT32_MAX;
+  static const uint8_t CLEAN = UINT8_MAX;
+
+  struct Set {
+    std::vector<uint32_t> tree;  // Fenwick tree over the set's access times
+    std::vector<uint32_t> owner; // block of each time slot, or NONE
+    uint32_t time;               // next time slot
+    uint32_t live;               // blocks with a one in the tree
+  };
+
+  struct Level {
+    uint32_t setCount;
+    std::vector<Set> sets;
+    std::unordered_map<uint32_t, uint32_t> setIndex; // set id -> sets index
+    // Per block (indexed as in blockIndex)
+    std::vector<uint32_t> blockSet;
+    std::vector<uint32_t> lastTime;
+    // The smallest associativity at which the block is dirty in the cache,
+    // i.e. the largest distance seen since its latest write, CLEAN if never
+    // written
+    std::vector<uint8_t> dirtyDistance;
+    // Accesses by capped distance, the last bucket holds cold misses and
+    // distances beyond maxAssociativity
+    std::vector<uint64_t> distances;
+    // Difference array over associativity of the dirty evictions
+    std::vector<int64_t> dirtyEvicts;
+  };
+
+  uint32_t blockBits;
+  uint32_t maxAssociativity;
+  uint64_t numRead, numWrite;
+  bool finished;
+  std::unordered_map<uint64_t, uint32_t> blockIndex; // block addr -> index
+  std::vector<Level> levels;
+
+  uint32_t distance(Set &set, uint32_t time);
+  void insert(Level &level, Set &set, uint32_t block);
+  void compact(Level &level, Set &set);
+  void countDirtyEvict(Level &level, uint8_t dirtyDistance, uint32_t distance);
+};
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * TLBs and page walks over MemoryManager's two level page table
+ */
+
+#include "Tlb.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+const uint32_t Mmu::PAGE_DIRECTORY;
+const uint32_t Mmu::PAGE_TABLES;
+
+Tlb::Tlb(uint32_t entries, uint32_t associativity) {
+  if (entries == 0 || associativity == 0 || entries % associativity != 0 ||
+      ((entries / associativity) & (entries / associativity - 1)) != 0) {
+    fprintf(stderr, "Invalid TLB of %d entries, %d ways\n", entries,
+            associativity);
+    exit(-1);
+  }
+  this->setCount = entries / associativity;
+  this->associativity = associativity;
+  this->useCounter = 0;
+  Entry entry;
+  entry.tag = 0;
+  entry.valid = false;
+  entry.superpage = false;
+  entry.lastUse = 0;
+  this->entries = std::vector<Entry>(entries, entry);
+  this->statistics.numAccess = 0;
+  this->statistics.numHit = 0;
+  this->statistics.numMiss = 0;
+}
+
+bool Tlb::probe(uint64_t page, bool superpage) {
+  Entry *set = &this->entries[(page & (this->setCount - 1)) * this->associativity];
+  for (uint32_t i = 0; i < this->associativity; ++i) {
+    if (set[i].valid && set[i].superpage == superpage && set[i].tag == page) {
+      set[i].lastUse = ++this->useCounter;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Tlb::lookup(uint64_t addr) {
+  this->statistics.numAccess++;
+  if (this->probe(addr >> 12, false) || this->probe(addr >> 22, true)) {
+    this->statistics.numHit++;
+    return true;
+  }
+  this->statistics.numMiss++;
+  return false;
+}
+
+// Fill an invalid way, else replace the LRU one
+void Tlb::insert(uint64_t addr, bool superpage) {
+  uint64_t page = superpage ? addr >> 22 : addr >> 12;
+  Entry *set = &this->entries[(page & (this->setCount - 1)) * this->associativity];
+  Entry *victim = &set[0];
+  for (uint32_t i = 0; i < this->associativity; ++i) {
+    if (!set[i].valid) {
+      victim = &set[i];
+      break;
+    }
+    if (set[i].lastUse < victim->lastUse)
+      victim = &set[i];
+  }
+  victim->tag = page;
+  victim->valid = true;
+  victim->superpage = superpage;
+  victim->lastUse = ++this->useCounter;
+}
+
+Mmu::Policy Mmu::defaultPolicy() {
+  Policy policy;
+  policy.itlbEntries = 64;
+  policy.dtlbEntries = 64;
+  policy.l2tlbEntries = 1024;
+  policy.l1Associativity = 4;
+  policy.l2Associativity = 8;
+  policy.l2HitLatency = 7;
+  policy.superpages = false;
+  return policy;
+}
+
+Mmu::Mmu(MemoryManager *memory, Policy policy)
+    : itlb(policy.itlbEntries, policy.l1Associativity),
+      dtlb(policy.dtlbEntries, policy.l1Associativity),
+      l2tlb(policy.l2tlbEntries, policy.l2Associativity) {
+  this->memory = memory;
+  this->policy = policy;
+  this->numWalk = 0;
+  this->walkCycles = 0;
+  // The tables are the simulator's, their pages come zeroed on demand and
+  // stay out of the program's memory
+  if (!memory->addReservedRegion(PAGE_DIRECTORY,
+                                 PAGE_TABLES + 1024ULL * 4096)) {
+    fprintf(stderr, "Page tables at 0x%x overlap the program!\n",
+            PAGE_DIRECTORY);
+    exit(-1);
+  }
+}
+
+uint32_t Mmu::translateInstruction(uint64_t addr) {
+  return this->translate(this->itlb, addr);
+}
+
+uint32_t Mmu::translateData(uint64_t addr) {
+  return this->translate(this->dtlb, addr);
+}
+
+uint32_t Mmu::translate(Tlb &tlb, uint64_t addr) {
+  if (tlb.lookup(addr))
+    return 0;
+  uint32_t cycles = this->policy.l2HitLatency;
+  if (!this->l2tlb.lookup(addr)) {
+    cycles += this->walk(addr);
+    this->l2tlb.insert(addr, this->policy.superpages);
+  }
+  tlb.insert(addr, this->policy.superpages);
+  return cycles;
+}
+
+uint32_t Mmu::walk(uint64_t addr) {
+  uint32_t i = (addr >> 22) & 0x3FF;
+  uint32_t j = (addr >> 12) & 0x3FF;
+  uint32_t cycles = this->readEntry(PAGE_DIRECTORY + i * 4);
+  if (!this->policy.superpages)
+    cycles += this->readEntry(PAGE_TABLES + i * 4096 + j * 4);
+  this->numWalk++;
+  this->walkCycles += cycles;
+  return cycles;
+}
+
+// Entries hold no translation, only their accesses matter
+uint32_t Mmu::readEntry(uint64_t entryAddr) {
+  uint32_t cycles = 0;
+  this->memory->getInt(entryAddr, &cycles);
+  return cycles;
+}
+
+void Mmu::printStatistics() {
+  printf("-------------- TLB --------------\n");
+  printf("Pages: %s\n", this->policy.superpages ? "4MB" : "4KB");
+  const Tlb *tlbs[] = {&this->itlb, &this->dtlb, &this->l2tlb};
+  const char *names[] = {"ITLB", "DTLB", "L2 TLB"};
+  for (int t = 0; t < 3; ++t) {
+    const Tlb::Statistics &s = tlbs[t]->statistics;
+    printf("%s: %llu accesses, %llu hits, %llu misses (%.4f miss rate)\n",
+           names[t], (unsigned long long)s.numAccess,
+           (unsigned long long)s.numHit, (unsigned long long)s.numMiss,
+           s.numAccess ? (double)s.numMiss / s.numAccess : 0.0);
+  }
+  printf("Page Walks: %llu, %llu cycles\n", (unsigned long long)this->numWalk,
+         (unsigned long long)this->walkCycles);
+}
@@ -0,0 +1,95 @@
+/*
+ * TLBs and page walks over MemoryManager's two level page table
+ *
+ * Addresses are identity mapped, only the cost of translation is modelled.
+ * Each core has an ITLB and a DTLB backed by a unified L2 TLB. A miss in both
+ * walks the page table: the first level entry, then the second level one,
+ * each a 4 byte read through the data cache hierarchy. The tables live at
+ * the top of the address space, the directory at PAGE_DIRECTORY (1024
+ * entries, one per first level id) and the 1024 second level tables from
+ * PAGE_TABLES on, so walks compete with the program for the caches. The
+ * range is reserved in memory: its pages come zeroed on demand, are never
+ * dumped or checkpointed and the program cannot map pages there. With
+ * superpages every first level entry maps a 4MB page and walks stop there.
+ * The tables model a 32 bit space, walks above 4GB use the entries of the
+ * address's low 32 bits.
+ */
+
+#ifndef TLB_H
+#define TLB_H
+
+#include <cstdint>
+#include <vector>
+
+#include "MemoryManager.h"
+
+class Tlb {
+public:
+  struct Statistics {
+    uint64_t numAccess;
+    uint64_t numHit;
+    uint64_t numMiss;
+  };
+
+  Tlb(uint32_t entries, uint32_t associativity);
+
+  // Looks up both the 4KB and the 4MB page of addr
+  bool lookup(uint64_t addr);
+  void insert(uint64_t addr, bool superpage);
+
+  Statistics statistics;
+
+private:
+  struct Entry {
+    uint64_t tag; // page number
+    bool valid;
+    bool superpage;
+    uint32_t lastUse;
+  };
+
+  uint32_t setCount;
+  uint32_t associativity;
+  uint32_t useCounter;
+  std::vector<Entry> entries;
+
+  bool probe(uint64_t page, bool superpage);
+};
+
+class Mmu {
+public:
+  struct Policy {
+    uint32_t itlbEntries;
+    uint32_t dtlbEntries;
+    uint32_t l2tlbEntries;
+    uint32_t l1Associativity;
+    uint32_t l2Associativity;
+    uint32_t l2HitLatency; // in cycles
+    bool superpages;
+  };
+
+  static const uint32_t PAGE_DIRECTORY = 0xFFBFF000;
+  static const uint32_t PAGE_TABLES = 0xFFC00000;
+
+  static Policy defaultPolicy();
+
+  Mmu(MemoryManager *memory, Policy policy);
+
+  // Cycles spent translating addr, 0 on an L1 TLB hit
+  uint32_t translateInstruction(uint64_t addr);
+  uint32_t translateData(uint64_t addr);
+
+  void printStatistics();
+
+private:
+  MemoryManager *memory;
+  Policy policy;
+  Tlb itlb, dtlb, l2tlb;
+  uint64_t numWalk;
+  uint64_t walkCycles;
+
+  uint32_t translate(Tlb &tlb, uint64_t addr);
+  uint32_t walk(uint64_t addr);
+  uint32_t readEntry(uint64_t entryAddr);
+};
+
+#endif
@@ -1,44 +1,83 @@
 /*
- * Convert trace to direnoIV trace format
+ * Convert trace to direnoIV trace format, or with -b to the binary trace
+ * format read by CacheSim and CacheOptimized (see Trace.h)
  *
  * Created By He, Hao in 2019/5/2
  */
 
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <string>
+
+#include "Trace.h"
 
 bool parseParameters(int argc, char **argv);
 void printUsage();
 
 const char *traceFilePath;
+bool toBinary = false;
 
 int main(int argc, char **argv) {
   if (!parseParameters(argc, argv)) {
+    printUsage();
     return -1;
   }
-  std::ifstream infile(traceFilePath);
-  std::ofstream outfile(std::string(traceFilePath) + ".d4");
-  if (!infile.is_open()) {
+  MemoryTrace trace;
+  if (!trace.open(traceFilePath)) {
     printf("Invalid file path %s\n", traceFilePath);
     return -1;
   }
 
-  char type;
-  uint32_t addr;
-  while (infile >> type >> std::hex >> addr) {
-    outfile << type << " " << std::hex << addr << " " << 1 << std::endl;
+  if (toBinary) {
+    std::string outPath = std::string(traceFilePath) + ".bin";
+    FILE *outfile = fopen(outPath.c_str(), "wb");
+    if (outfile == nullptr ||
+        fwrite(trace.image(), 1, trace.imageSize(), outfile) !=
+            trace.imageSize()) {
+      printf("Unable to write %s\n", outPath.c_str());
+      return -1;
+    }
+    fclose(outfile);
+    printf("%lu accesses written to %s\n", (unsigned long)trace.size(),
+           outPath.c_str());
+    return 0;
+  }
+
+  std::ofstream outfile(std::string(traceFilePath) + ".d4");
+  MemoryTrace::Cursor cursor = trace.cursor();
+  MemoryTrace::Access access;
+  while (cursor.read(access)) {
+    outfile << access.type << " " << std::hex << access.addr << " "
+            << (unsigned)access.size << "\n";
   }
   return 0;
 }
 
 bool parseParameters(int argc, char **argv) {
   // Read Parameters
-  if (argc > 1) {
-    traceFilePath = argv[1];
-    return true;
-  } else {
-    return false;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] == '-') {
+      switch (argv[i][1]) {
+      case 'b':
+        toBinary = true;
+        break;
+      default:
+        return false;
+      }
+    } else {
+      if (traceFilePath == nullptr) {
+        traceFilePath = argv[i];
+      } else {
+        return false;
+      }
+    }
   }
+  return traceFilePath != nullptr;
 }
 
-void printUsage() { printf("Usage: CacheSim trace-file\n"); }
\ No newline at end of file
+void printUsage() {
+  printf("Usage: ToDirenoTrace trace-file [-b]\n");
+  printf("Parameters: -b write a binary trace (trace-file.bin) instead of "
+         "dinero text (trace-file.d4)\n");
+}
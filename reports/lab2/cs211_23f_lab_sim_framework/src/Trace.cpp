@@ -0,0 +1,277 @@
+/*
+ * Memory trace shared by the trace driven simulators
+ */
+
+#include "Trace.h"
+
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Debug.h"
+
+namespace {
+
+const char MAGIC[4] = {'M', 'T', 'R', 'C'};
+
+inline bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+inline int hexValue(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+void encodeDelta(std::vector<uint8_t> &out, uint64_t from, uint64_t to) {
+  int64_t delta = (int64_t)(to - from);
+  uint64_t v = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+  while (v >= 0x80) {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+// Check that a stream holds exactly n well formed 64 bit varints
+bool checkVarints(const uint8_t *p, uint32_t bytes, uint32_t n) {
+  const uint8_t *end = p + bytes;
+  for (uint32_t i = 0; i < n; ++i) {
+    for (int len = 0;; ++len) {
+      if (p == end || len == 10)
+        return false;
+      if (!(*p++ & 0x80))
+        break;
+    }
+  }
+  return p == end;
+}
+
+} // namespace
+
+bool MemoryTrace::Cursor::loadChunk() {
+  if (this->next == this->end)
+    return false;
+  ChunkHeader chunk;
+  memcpy(&chunk, this->next, sizeof(chunk));
+  this->bitmap = this->next + sizeof(chunk);
+  this->addrStream = this->bitmap + (chunk.count + 7) / 8;
+  this->pcStream = this->addrStream + chunk.addrBytes;
+  this->sizes = this->pcStream + chunk.pcBytes;
+  this->next = this->sizes + ((this->flags & HAS_SIZE) ? chunk.count : 0);
+  this->left = chunk.count;
+  this->index = 0;
+  this->addr = 0;
+  this->pc = 0;
+  return this->left > 0 || this->loadChunk();
+}
+
+MemoryTrace::Writer::Writer(uint16_t flags) {
+  this->flags = flags;
+  this->count = 0;
+  this->chunkCount = 0;
+  this->lastAddr = 0;
+  this->lastPC = 0;
+  this->image.resize(sizeof(FileHeader));
+}
+
+void MemoryTrace::Writer::append(const Access &access) {
+  if (this->chunkCount % 8 == 0)
+    this->bitmap.push_back(0);
+  if (access.type == 'w')
+    this->bitmap.back() |= 1 << (this->chunkCount % 8);
+  encodeDelta(this->addrStream, this->lastAddr, access.addr);
+  this->lastAddr = access.addr;
+  if (this->flags & HAS_PC) {
+    encodeDelta(this->pcStream, this->lastPC, access.pc);
+    this->lastPC = access.pc;
+  }
+  if (this->flags & HAS_SIZE)
+    this->sizes.push_back(access.size);
+  this->count++;
+  if (++this->chunkCount == CHUNK_RECORDS)
+    this->flushChunk();
+}
+
+void MemoryTrace::Writer::flushChunk() {
+  if (this->chunkCount == 0)
+    return;
+  ChunkHeader chunk;
+  chunk.count = this->chunkCount;
+  chunk.addrBytes = this->addrStream.size();
+  chunk.pcBytes = this->pcStream.size();
+  const uint8_t *raw = (const uint8_t *)&chunk;
+  this->image.insert(this->image.end(), raw, raw + sizeof(chunk));
+  this->image.insert(this->image.end(), this->bitmap.begin(),
+                     this->bitmap.end());
+  this->image.insert(this->image.end(), this->addrStream.begin(),
+                     this->addrStream.end());
+  this->image.insert(this->image.end(), this->pcStream.begin(),
+                     this->pcStream.end());
+  this->image.insert(this->image.end(), this->sizes.begin(),
+                     this->sizes.end());
+  this->bitmap.clear();
+  this->addrStream.clear();
+  this->pcStream.clear();
+  this->sizes.clear();
+  this->chunkCount = 0;
+  this->lastAddr = 0;
+  this->lastPC = 0;
+}
+
+const std::vector<uint8_t> &MemoryTrace::Writer::finish() {
+  this->flushChunk();
+  FileHeader header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.flags = this->flags;
+  header.chunkRecords = CHUNK_RECORDS;
+  header.reserved = 0;
+  header.count = this->count;
+  memcpy(this->image.data(), &header, sizeof(header));
+  return this->image;
+}
+
+MemoryTrace::MemoryTrace() {
+  memset(&this->header, 0, sizeof(this->header));
+  this->base = nullptr;
+  this->length = 0;
+  this->mapping = nullptr;
+}
+
+MemoryTrace::~MemoryTrace() { this->close(); }
+
+void MemoryTrace::close() {
+  if (this->mapping != nullptr)
+    munmap(this->mapping, this->length);
+  this->mapping = nullptr;
+  this->owned.clear();
+  this->base = nullptr;
+  this->length = 0;
+  memset(&this->header, 0, sizeof(this->header));
+}
+
+bool MemoryTrace::open(const char *path) {
+  this->close();
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  char magic[4];
+  bool binary = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(FileHeader) &&
+                pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+                memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+  if (!binary) {
+    ::close(fd);
+    return this->parseText(path);
+  }
+
+  this->mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (this->mapping == MAP_FAILED) {
+    this->mapping = nullptr;
+    return false;
+  }
+  madvise(this->mapping, st.st_size, MADV_SEQUENTIAL);
+  this->base = (const uint8_t *)this->mapping;
+  this->length = st.st_size;
+  memcpy(&this->header, this->base, sizeof(this->header));
+  if (this->header.version != VERSION || !this->validate()) {
+    dbgprintf("Malformed binary trace %s\n", path);
+    this->close();
+    return false;
+  }
+  return true;
+}
+
+// Check every chunk once so that cursors can decode without bound checks
+bool MemoryTrace::validate() {
+  const uint8_t *p = this->base + sizeof(FileHeader);
+  const uint8_t *end = this->base + this->length;
+  uint64_t total = 0;
+  while (p != end) {
+    ChunkHeader chunk;
+    if ((size_t)(end - p) < sizeof(chunk))
+      return false;
+    memcpy(&chunk, p, sizeof(chunk));
+    p += sizeof(chunk);
+    uint64_t bytes = (chunk.count + 7) / 8 + (uint64_t)chunk.addrBytes +
+                     chunk.pcBytes +
+                     ((this->header.flags & HAS_SIZE) ? chunk.count : 0);
+    if ((uint64_t)(end - p) < bytes)
+      return false;
+    const uint8_t *addrStream = p + (chunk.count + 7) / 8;
+    if (!checkVarints(addrStream, chunk.addrBytes, chunk.count))
+      return false;
+    if (!checkVarints(addrStream + chunk.addrBytes, chunk.pcBytes,
+                      (this->header.flags & HAS_PC) ? chunk.count : 0))
+      return false;
+    p += bytes;
+    total += chunk.count;
+  }
+  return total == this->header.count;
+}
+
+bool MemoryTrace::parseText(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr)
+    return false;
+  std::vector<char> text;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+    text.insert(text.end(), buf, buf + n);
+  fclose(file);
+
+  // Same tokens as `trace >> type >> std::hex >> addr`, stop at the first
+  // malformed record
+  Writer writer;
+  Access access;
+  access.pc = 0;
+  access.size = 1;
+  const char *p = text.data(), *end = text.data() + text.size();
+  while (true) {
+    while (p < end && isSpace(*p))
+      p++;
+    if (p == end)
+      break;
+    access.type = *p++;
+    while (p < end && isSpace(*p))
+      p++;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') &&
+        hexValue(p[2]) >= 0)
+      p += 2;
+    if (p == end || hexValue(*p) < 0)
+      break;
+    // An address that does not fit fails the extraction as well
+    uint64_t addr = 0;
+    for (int v; p < end && (v = hexValue(*p)) >= 0; p++) {
+      if (addr <= UINT32_MAX)
+        addr = (addr << 4) | v;
+    }
+    if (addr > UINT32_MAX) {
+      dbgprintf("Address out of range, trace ends before it\n");
+      break;
+    }
+    access.addr = addr;
+    if (access.type != 'r' && access.type != 'w') {
+      dbgprintf("Illegal type %c\n", access.type);
+      return false;
+    }
+    writer.append(access);
+  }
+
+  this->owned = writer.finish();
+  this->base = this->owned.data();
+  this->length = this->owned.size();
+  memcpy(&this->header, this->base, sizeof(this->header));
+  return true;
+}
@@ -0,0 +1,158 @@
+/*
+ * Memory trace shared by the trace driven simulators
+ *
+ * Traces are kept in a compact chunked binary format. Binary trace files are
+ * mmapped and decoded in place, text traces ("r 7fffe3c0" per line) are
+ * encoded into the same format once when opened. The trace is read-only after
+ * open(), so any number of cursors may replay it concurrently.
+ *
+ * Addresses and PCs are 64 bit. Text traces hold 32 bit addresses and end at
+ * a wider one, as they always have.
+ *
+ * Binary layout (all integers little endian):
+ *   FileHeader
+ *   chunk*: ChunkHeader, type bitmap ((count + 7) / 8 bytes, bit set for
+ *           write), address deltas (addrBytes bytes of 64 bit zigzag
+ *           varints, the first delta of a chunk is against 0), PC deltas (pcBytes bytes,
+ *           only with HAS_PC), access sizes (count bytes, only with HAS_SIZE)
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+class MemoryTrace {
+public:
+  enum Flag {
+    HAS_PC = 1,
+    HAS_SIZE = 2,
+  };
+
+  struct Access {
+    uint64_t addr;
+    uint64_t pc;  // 0 if the trace has no PC field
+    uint8_t size; // in bytes, 1 if the trace has no size field
+    char type;    // 'r' for read, 'w' for write
+  };
+
+  struct FileHeader {
+    char magic[4]; // "MTRC"
+    uint16_t version;
+    uint16_t flags;
+    uint32_t chunkRecords; // records per chunk, the last one may be shorter
+    uint32_t reserved;
+    uint64_t count; // total records
+  };
+
+  struct ChunkHeader {
+    uint32_t count;
+    uint32_t addrBytes;
+    uint32_t pcBytes;
+  };
+
+  static const uint16_t VERSION = 1;
+  static const uint32_t CHUNK_RECORDS = 64 * 1024;
+
+  // Sequential decoder over the chunks of a trace
+  class Cursor {
+  public:
+    Cursor(const uint8_t *begin, const uint8_t *end, uint16_t flags)
+        : next(begin), end(end), flags(flags), left(0), index(0) {}
+
+    // Decode the next access, return false at the end of the trace
+    inline bool read(Access &access) {
+      if (this->left == 0 && !this->loadChunk())
+        return false;
+      access.type = (this->bitmap[this->index >> 3] >> (this->index & 7)) & 1
+                        ? 'w'
+                        : 'r';
+      this->addr += decodeDelta(this->addrStream);
+      access.addr = this->addr;
+      if (this->flags & HAS_PC) {
+        this->pc += decodeDelta(this->pcStream);
+        access.pc = this->pc;
+      } else {
+        access.pc = 0;
+      }
+      access.size = (this->flags & HAS_SIZE) ? this->sizes[this->index] : 1;
+      this->index++;
+      this->left--;
+      return true;
+    }
+
+  private:
+    const uint8_t *next, *end;
+    uint16_t flags;
+    uint32_t left, index;
+    const uint8_t *bitmap, *addrStream, *pcStream, *sizes;
+    uint64_t addr, pc;
+
+    bool loadChunk();
+  };
+
+  // Encoder producing a complete binary trace image
+  class Writer {
+  public:
+    explicit Writer(uint16_t flags = 0);
+    void append(const Access &access);
+    // Flush the last chunk and return the image, the writer is then done
+    const std::vector<uint8_t> &finish();
+
+  private:
+    uint16_t flags;
+    uint64_t count;
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> bitmap, addrStream, pcStream, sizes;
+    uint32_t chunkCount;
+    uint64_t lastAddr, lastPC;
+
+    void flushChunk();
+  };
+
+  MemoryTrace();
+  ~MemoryTrace();
+  MemoryTrace(const MemoryTrace &) = delete;
+  MemoryTrace &operator=(const MemoryTrace &) = delete;
+
+  // Open a binary or text trace, return false if the file cannot be opened
+  // or is malformed
+  bool open(const char *path);
+
+  uint64_t size() const { return this->header.count; }
+  uint16_t flags() const { return this->header.flags; }
+  Cursor cursor() const {
+    return Cursor(this->base + sizeof(FileHeader), this->base + this->length,
+                  this->header.flags);
+  }
+  // The binary image, e.g. to save a converted text trace
+  const uint8_t *image() const { return this->base; }
+  size_t imageSize() const { return this->length; }
+
+private:
+  FileHeader header;
+  const uint8_t *base;
+  size_t length;
+  void *mapping;              // mmapped binary file, or nullptr
+  std::vector<uint8_t> owned; // encoded text trace
+
+  bool parseText(const char *path);
+  bool validate();
+  void close();
+
+  static inline int64_t decodeDelta(const uint8_t *&p) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t b = *p++;
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        break;
+    }
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  }
+};
+
+#endif